@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../gblfifo_async/gblfifo.h"
+
+#define MAX_THREADS 16
+#define MAX_SAMPLES (1 << 20)
+#define RING_SIZE (256 << 10)
+
+enum notify { N_BLOCK, N_SELECT, N_POLL, N_EPOLL, N_SIGIO, N_MAX };
+static const char *notify_names[] = {
+    "block", "select", "poll", "epoll", "sigio"};
+
+struct config {
+  const char *dev;
+  int mem; /* gblmem instead of gblfifo */
+  enum notify notify;
+  size_t size;
+  int producers, consumers;
+  long duration_ms;
+  int record; /* gblfifo delivers whole messages */
+};
+
+struct worker {
+  pthread_t tid;
+  const struct config *cfg;
+  int fd;
+  int writer; /* gblmem only */
+  long long ops, bytes;
+  long long *lat;
+  long nr_lat, max_lat;
+  unsigned seed;
+};
+
+static volatile int stop;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+static void sample(struct worker *w, long long ns) {
+  if (w->nr_lat < w->max_lat) w->lat[w->nr_lat++] = ns;
+}
+
+/* the basic drivers may take a message in several pieces */
+static void write_msg(int fd, const char *buf, size_t size) {
+  size_t off = 0;
+
+  while (off < size) {
+    ssize_t n = write(fd, buf + off, size - off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      die("write");
+    }
+    off += n;
+  }
+}
+
+/* every message starts with its send time, 0 tells the consumer to quit */
+static void *producer(void *arg) {
+  struct worker *w = arg;
+  char *buf = calloc(1, w->cfg->size);
+
+  while (!stop) {
+    long long ts = now_ns();
+    memcpy(buf, &ts, sizeof(ts));
+    write_msg(w->fd, buf, w->cfg->size);
+    w->ops++;
+    w->bytes += w->cfg->size;
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static void wait_readable(struct worker *w, int epfd, sigset_t *sigs) {
+  struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+  struct timespec timeout = {0, 100000000};
+  struct epoll_event ev;
+  fd_set rfds;
+
+  switch (w->cfg->notify) {
+  case N_BLOCK: break;
+  case N_SELECT:
+    FD_ZERO(&rfds);
+    FD_SET(w->fd, &rfds);
+    select(w->fd + 1, &rfds, NULL, NULL, NULL);
+    break;
+  case N_POLL: poll(&pfd, 1, -1); break;
+  case N_EPOLL: epoll_wait(epfd, &ev, 1, -1); break;
+  /* SIGIO is edge triggered, the timeout only guards against bugs */
+  case N_SIGIO: sigtimedwait(sigs, NULL, &timeout); break;
+  default: break;
+  }
+}
+
+static void *consumer(void *arg) {
+  struct worker *w = arg;
+  size_t size = w->cfg->size, fill = 0;
+  char *buf = malloc(size);
+  struct epoll_event ev = {.events = EPOLLIN};
+  int epfd = -1;
+  sigset_t sigs;
+
+  if (w->cfg->notify == N_EPOLL) {
+    epfd = epoll_create1(0);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0) die("epoll_ctl");
+  }
+  if (w->cfg->notify == N_SIGIO) {
+    struct f_owner_ex owner = {F_OWNER_TID, syscall(SYS_gettid)};
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGRTMIN);
+    if (fcntl(w->fd, F_SETOWN_EX, &owner) < 0 ||
+        fcntl(w->fd, F_SETSIG, SIGRTMIN) < 0 ||
+        fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_ASYNC) < 0)
+      die("fcntl");
+  }
+
+  for (;;) {
+    wait_readable(w, epfd, &sigs);
+
+    /* drain until EAGAIN, a stream FIFO may hand out partial messages */
+    for (;;) {
+      ssize_t n = read(w->fd, buf + fill, size - fill);
+      if (n < 0) {
+        if (errno == EAGAIN) break;
+        if (errno == EINTR) continue;
+        die("read");
+      }
+      fill += n;
+      if (fill < size) continue;
+      fill = 0;
+
+      long long ts;
+      memcpy(&ts, buf, sizeof(ts));
+      if (ts == 0) goto out;
+      sample(w, now_ns() - ts);
+      w->ops++;
+      w->bytes += size;
+    }
+  }
+
+out:
+  if (epfd >= 0) close(epfd);
+  free(buf);
+  return NULL;
+}
+
+/* gblmem has no queue, producers pwrite and consumers pread at random */
+static void *mem_worker(void *arg) {
+  struct worker *w = arg;
+  size_t size = w->cfg->size;
+  off_t region = lseek(w->fd, 0, SEEK_END);
+  char *buf = calloc(1, size);
+  int writer = w->writer;
+
+  while (!stop) {
+    off_t off = (off_t)(rand_r(&w->seed) % (region / size)) * size;
+    long long start = now_ns();
+    ssize_t n = writer ? pwrite(w->fd, buf, size, off)
+                       : pread(w->fd, buf, size, off);
+    if (n < 0) die(writer ? "pwrite" : "pread");
+    sample(w, now_ns() - start);
+    w->ops++;
+    w->bytes += n;
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static long long percentile(long long *lat, long n, double p) {
+  if (n == 0) return 0;
+  return lat[(long)(p * (n - 1))];
+}
+
+static int open_dev(const struct config *cfg, int flags) {
+  int fd = open(cfg->dev, flags);
+  if (fd < 0) die(cfg->dev);
+  return fd;
+}
+
+static void run(struct config *cfg) {
+  struct worker w[2 * MAX_THREADS] = {0};
+  int nr = cfg->producers + cfg->consumers;
+  long max_lat = MAX_SAMPLES / nr;
+  long long *lat = malloc(sizeof(*lat) * MAX_SAMPLES);
+  long long ops = 0, bytes = 0, start, elapsed;
+  long nr_lat = 0;
+  int ctl = open_dev(cfg, O_RDWR), rd_flags = O_RDONLY;
+
+  if (cfg->mem) {
+    off_t region = lseek(ctl, 0, SEEK_END);
+    if (region < (off_t)cfg->size) goto out;
+  } else {
+    struct gblfifo_stats stats;
+
+    ioctl(ctl, FIFO_CLEAR, 0);
+    /* whole messages per read let several consumers share one FIFO */
+    cfg->record = ioctl(ctl, GBLFIFO_SET_MODE, GBLFIFO_MODE_RECORD) == 0;
+    if (!cfg->record && (cfg->producers > 1 || cfg->consumers > 1)) goto out;
+    /* a record has to fit the ring with its header */
+    ioctl(ctl, GBLFIFO_SET_SIZE, RING_SIZE);
+    if (cfg->record && (ioctl(ctl, GBLFIFO_GET_STATS, &stats) < 0 ||
+                           cfg->size + sizeof(__u32) > stats.size))
+      goto out;
+    if (cfg->notify != N_BLOCK) rd_flags |= O_NONBLOCK;
+  }
+
+  stop = 0;
+  for (int i = 0; i < nr; i++) {
+    int is_producer = i < cfg->producers;
+    w[i].cfg = cfg;
+    w[i].seed = i + 1;
+    w[i].lat = lat + i * max_lat;
+    w[i].max_lat = max_lat;
+    if (cfg->mem) {
+      w[i].fd = open_dev(cfg, O_RDWR);
+      w[i].writer = is_producer;
+    } else {
+      w[i].fd = open_dev(cfg, is_producer ? O_WRONLY : rd_flags);
+    }
+  }
+
+  start = now_ns();
+  for (int i = 0; i < nr; i++) {
+    void *(*fn)(void *) =
+        cfg->mem ? mem_worker : i < cfg->producers ? producer : consumer;
+    pthread_create(&w[i].tid, NULL, fn, &w[i]);
+  }
+
+  usleep(cfg->duration_ms * 1000);
+  stop = 1;
+  for (int i = 0; i < cfg->producers; i++) pthread_join(w[i].tid, NULL);
+
+  if (!cfg->mem) {
+    /* one poison message per consumer */
+    char *poison = calloc(1, cfg->size);
+    for (int i = 0; i < cfg->consumers; i++) write_msg(ctl, poison, cfg->size);
+    free(poison);
+  }
+  for (int i = cfg->producers; i < nr; i++) pthread_join(w[i].tid, NULL);
+  elapsed = now_ns() - start;
+
+  /* a FIFO is measured at the consumers, gblmem over every operation */
+  for (int i = cfg->mem ? 0 : cfg->producers; i < nr; i++) {
+    memmove(lat + nr_lat, w[i].lat, sizeof(*lat) * w[i].nr_lat);
+    nr_lat += w[i].nr_lat;
+    ops += w[i].ops;
+    bytes += w[i].bytes;
+  }
+  for (int i = 0; i < nr; i++) close(w[i].fd);
+  qsort(lat, nr_lat, sizeof(*lat), cmp_ll);
+
+  printf("%s,%s,%zu,%d,%d,%.0f,%.2f,%lld,%lld,%lld\n",
+         cfg->mem ? "gblmem" : "gblfifo", notify_names[cfg->notify], cfg->size,
+         cfg->producers, cfg->consumers, ops * 1e9 / elapsed,
+         bytes * 1e3 / elapsed, percentile(lat, nr_lat, 0.5),
+         percentile(lat, nr_lat, 0.99), percentile(lat, nr_lat, 0.999));
+  fflush(stdout);
+
+out:
+  if (!cfg->mem) ioctl(ctl, GBLFIFO_SET_MODE, 0);
+  close(ctl);
+  free(lat);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+      "usage: %s [-m] [-d dev] [-T ms] [-s size] [-p producers] "
+      "[-c consumers] [-n block|select|poll|epoll|sigio]\n"
+      "  -m  benchmark gblmem (pread/pwrite) instead of gblfifo\n"
+      "  a parameter that is not given is swept\n",
+      prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  static const size_t sizes[] = {16, 64, 256, 1024, 4096};
+  static const int threads[] = {1, 2, 4};
+  struct config cfg = {.dev = "/dev/gblfifo0", .duration_ms = 1000};
+  size_t size = 0;
+  int producers = 0, consumers = 0, notify = -1, opt;
+  sigset_t sigs;
+
+  while ((opt = getopt(argc, argv, "md:T:s:p:c:n:")) != -1) {
+    switch (opt) {
+    case 'm': cfg.mem = 1; break;
+    case 'd': cfg.dev = optarg; break;
+    case 'T': cfg.duration_ms = atol(optarg); break;
+    case 's': size = strtoul(optarg, NULL, 0); break;
+    case 'p': producers = atoi(optarg); break;
+    case 'c': consumers = atoi(optarg); break;
+    case 'n':
+      for (notify = 0; notify < N_MAX; notify++)
+        if (!strcmp(optarg, notify_names[notify])) break;
+      if (notify == N_MAX) usage(argv[0]);
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if (producers > MAX_THREADS || consumers > MAX_THREADS) usage(argv[0]);
+
+  /* SIGIO consumers collect their signal with sigtimedwait */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGRTMIN);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  printf("target,notify,msg_size,producers,consumers,ops_per_sec,mb_per_sec,"
+         "p50_ns,p99_ns,p999_ns\n");
+
+  for (int n = 0; n < N_MAX; n++) {
+    if (notify >= 0 ? n != notify : cfg.mem && n != N_BLOCK) continue;
+    for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      if (size && s > 0) break;
+      for (unsigned p = 0; p < sizeof(threads) / sizeof(threads[0]); p++) {
+        if (producers && p > 0) break;
+        for (unsigned c = 0; c < sizeof(threads) / sizeof(threads[0]); c++) {
+          if (consumers && c > 0) break;
+          cfg.notify = n;
+          cfg.size = size ? size : sizes[s];
+          cfg.producers = producers ? producers : threads[p];
+          cfg.consumers = consumers ? consumers : threads[c];
+          run(&cfg);
+        }
+      }
+    }
+  }
+
+  return 0;
+}
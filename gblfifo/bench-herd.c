@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FIFO_CLEAR 0x1
+#define MSG 16
+#define ROUNDS 20000
+#define MAX_READERS 64
+
+static const char *path;
+static long consumed;
+static long switches;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* block in read() on a private fd, count how often we got scheduled */
+static void *reader(void *arg) {
+  long budget = (long)arg;
+  char buf[MSG];
+  struct rusage ru;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open.reader");
+    exit(1);
+  }
+
+  while (budget--) {
+    if (read(fd, buf, MSG) != MSG) {
+      perror("read");
+      exit(1);
+    }
+    __atomic_add_fetch(&consumed, 1, __ATOMIC_RELEASE);
+  }
+
+  getrusage(RUSAGE_THREAD, &ru);
+  __atomic_add_fetch(&switches, ru.ru_nvcsw, __ATOMIC_RELAXED);
+  close(fd);
+  return NULL;
+}
+
+/*
+ * N readers sleep on the empty FIFO and a single writer posts one message at
+ * a time, waiting for it to be taken before posting the next. Every message
+ * should cost about one reader wakeup; with a thundering herd all N readers
+ * wake up and all but one go back to sleep, so switches/msg grows with N.
+ */
+static void bench(int fd, int nr) {
+  pthread_t tid[MAX_READERS];
+  char buf[MSG] = {0};
+  long total = (long)ROUNDS * nr;
+
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0) {
+    perror("ioctl.FIFO_CLEAR");
+    exit(1);
+  }
+  consumed = switches = 0;
+
+  for (int i = 0; i < nr; i++)
+    pthread_create(&tid[i], NULL, reader, (void *)(long)ROUNDS);
+  usleep(100000);
+
+  long long start = now_ns();
+  for (long i = 0; i < total; i++) {
+    if (write(fd, buf, MSG) != MSG) {
+      perror("write");
+      exit(1);
+    }
+    while (__atomic_load_n(&consumed, __ATOMIC_ACQUIRE) <= i)
+      ;
+  }
+  long long elapsed = now_ns() - start;
+
+  for (int i = 0; i < nr; i++) pthread_join(tid[i], NULL);
+
+  printf("%d,%.2f,%.0f\n", nr, (double)switches / total,
+         total * 1e9 / elapsed);
+}
+
+int main(int argc, const char *argv[]) {
+  static const int readers[] = {1, 2, 4, 8, 16, 32, 64};
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+  path = argv[1];
+
+  int fd = open(path, O_WRONLY);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  printf("readers,switches_per_msg,msgs_per_sec\n");
+  for (unsigned i = 0; i < sizeof(readers) / sizeof(readers[0]); i++)
+    bench(fd, readers[i]);
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FIFO_CLEAR 0x1
+#define GBLFIFO_SIZE 1024
+#define CHUNK 16
+#define ROUNDS 200000
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Keep `backlog` bytes queued and time CHUNK-byte reads against it: each
+ * round writes CHUNK bytes and reads CHUNK bytes back, so the backlog stays
+ * constant. With a ring buffer the read cost must not grow with backlog.
+ */
+static double bench(int fd, int backlog) {
+  char buf[GBLFIFO_SIZE] = {0};
+  long long total = 0;
+
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0) {
+    perror("ioctl.FIFO_CLEAR");
+    exit(1);
+  }
+  if (backlog && write(fd, buf, backlog) != backlog) {
+    perror("write.backlog");
+    exit(1);
+  }
+
+  for (int i = 0; i < ROUNDS; i++) {
+    if (write(fd, buf, CHUNK) != CHUNK) {
+      perror("write");
+      exit(1);
+    }
+    long long start = now_ns();
+    if (read(fd, buf, CHUNK) != CHUNK) {
+      perror("read");
+      exit(1);
+    }
+    total += now_ns() - start;
+  }
+
+  return (double)total / ROUNDS;
+}
+
+int main(int argc, const char *argv[]) {
+  static const int backlogs[] = {0, 64, 256, 512, 768, GBLFIFO_SIZE - CHUNK};
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  printf("backlog,ns_per_read\n");
+  for (unsigned i = 0; i < sizeof(backlogs) / sizeof(backlogs[0]); i++)
+    printf("%d,%.1f\n", backlogs[i], bench(fd, backlogs[i]));
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MSG 64
+#define DURATION_NS 2000000000LL
+#define MAX_FIFOS 128
+
+static int fds[MAX_FIFOS], minors[MAX_FIFOS];
+static int nr_fifos;
+static volatile int stop;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* keep every FIFO busy, round robin, never sleeping */
+static void *producer(void *arg) {
+  char buf[MSG] = {0};
+
+  (void)arg;
+  while (!stop) {
+    for (int i = 0; i < nr_fifos; i++) write(fds[i], buf, MSG);
+  }
+  return NULL;
+}
+
+/*
+ * One thread drains nr FIFOs through epoll while another keeps writing to
+ * all of them. Every epoll_wait polls each ready FIFO again, so with a poll
+ * that takes the FIFO mutex, epoll_wait time grows with the number of FIFOs
+ * and with the producer's copies.
+ */
+static void bench(int ctl, int nr) {
+  struct epoll_event evs[MAX_FIFOS], ev = {.events = EPOLLIN};
+  char buf[4096], path[64];
+  long long bytes = 0, msgs = 0, waits = 0, wait_ns = 0;
+  pthread_t tid;
+
+  nr_fifos = nr;
+  int epfd = epoll_create1(0);
+  for (int i = 0; i < nr; i++) {
+    minors[i] = ioctl(ctl, GBLFIFO_CTL_CREATE, 0);
+    if (minors[i] < 0) {
+      perror("ioctl.GBLFIFO_CTL_CREATE");
+      exit(1);
+    }
+    snprintf(path, sizeof(path), "/dev/gblfifo%d", minors[i]);
+    fds[i] = open(path, O_RDWR | O_NONBLOCK);
+    if (fds[i] < 0) {
+      perror(path);
+      exit(1);
+    }
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+  }
+
+  stop = 0;
+  pthread_create(&tid, NULL, producer, NULL);
+
+  long long start = now_ns(), end = start + DURATION_NS;
+  while (now_ns() < end) {
+    long long t = now_ns();
+    int n = epoll_wait(epfd, evs, MAX_FIFOS, 100);
+    wait_ns += now_ns() - t;
+    waits++;
+
+    for (int i = 0; i < n; i++) {
+      ssize_t got = read(fds[evs[i].data.u32], buf, sizeof(buf));
+      if (got > 0) {
+        bytes += got;
+        msgs += got / MSG;
+      } else if (got < 0 && errno != EAGAIN) {
+        perror("read");
+        exit(1);
+      }
+    }
+  }
+  long long elapsed = now_ns() - start;
+
+  stop = 1;
+  pthread_join(tid, NULL);
+  close(epfd);
+  for (int i = 0; i < nr; i++) {
+    close(fds[i]);
+    ioctl(ctl, GBLFIFO_CTL_DESTROY, minors[i]);
+  }
+
+  printf("%d,%.0f,%.1f,%.0f\n", nr, msgs * 1e9 / elapsed,
+         bytes * 1e3 / elapsed, (double)wait_ns / waits);
+}
+
+int main(int argc, const char *argv[]) {
+  static const int counts[] = {1, 8, 32, 128};
+
+  if (argc < 2) {
+    printf("need gblfifo_ctl cdev file\n");
+    return 0;
+  }
+
+  int ctl = open(argv[1], O_RDWR);
+  if (ctl < 0) {
+    perror("open");
+    return 0;
+  }
+
+  printf("fifos,msgs_per_sec,mb_per_sec,ns_per_epoll_wait\n");
+  for (unsigned i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    bench(ctl, counts[i]);
+
+  close(ctl);
+  return 0;
+}
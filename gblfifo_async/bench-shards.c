@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MSG 64
+#define BATCH 64
+#define RING (64 << 10)
+#define DURATION_NS 1000000000LL
+#define MAX_PRODUCERS 1024
+
+struct msg {
+  uint32_t producer;
+  uint64_t nr;
+  char pad[MSG - 16];
+};
+
+static int rfd, wfd;
+static volatile int stop, done;
+static long long written[MAX_PRODUCERS];
+static uint64_t last[MAX_PRODUCERS];
+static long long out_of_order;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void pin(int cpu) {
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* blocking writes from one CPU, numbered so the reader can check order */
+static void *producer(void *arg) {
+  int id = (int)(long)arg;
+  struct msg m = {.producer = id};
+
+  /* ids are taken as CPU numbers, a hole in the online mask stays unpinned */
+  pin(id);
+  while (!stop) {
+    m.nr = written[id] + 1;
+    if (write(wfd, &m, MSG) != MSG) {
+      perror("write");
+      exit(1);
+    }
+    written[id]++;
+  }
+  return NULL;
+}
+
+/*
+ * Spins on a non-blocking RECV_BATCH, so it never waits for a wakeup and
+ * the producers are what limits the rate. A producer stays on its CPU, so
+ * its messages must come out in order in every mode.
+ */
+static void *consumer(void *arg) {
+  static struct msg buf[BATCH];
+  uint32_t lens[BATCH];
+  struct gblfifo_batch batch = {
+      .buf = (uintptr_t)buf,
+      .lens = (uintptr_t)lens,
+      .buf_len = sizeof(buf),
+      .max_msgs = BATCH,
+  };
+
+  (void)arg;
+  while (!done) {
+    if (ioctl(rfd, GBLFIFO_RECV_BATCH, &batch) < 0) {
+      if (errno == EAGAIN) continue;
+      perror("ioctl.GBLFIFO_RECV_BATCH");
+      exit(1);
+    }
+    for (unsigned i = 0; i < batch.nr_msgs; i++) {
+      struct msg *m = &buf[i];
+
+      if (m->nr != last[m->producer] + 1) out_of_order++;
+      last[m->producer] = m->nr;
+    }
+  }
+  return NULL;
+}
+
+/* nr pinned producers against one consumer for DURATION_NS */
+static void bench(int ctl, const char *name, unsigned mode, int nr) {
+  pthread_t tids[MAX_PRODUCERS], ctid;
+  long long msgs = 0;
+  char path[64];
+
+  int minor = ioctl(ctl, GBLFIFO_CTL_CREATE, RING);
+  if (minor < 0) {
+    perror("ioctl.GBLFIFO_CTL_CREATE");
+    exit(1);
+  }
+  snprintf(path, sizeof(path), "/dev/gblfifo%d", minor);
+  /* the consumer doesn't block, producers do */
+  wfd = open(path, O_RDWR);
+  rfd = open(path, O_RDWR | O_NONBLOCK);
+  if (wfd < 0 || rfd < 0) {
+    perror(path);
+    exit(1);
+  }
+  if (ioctl(wfd, GBLFIFO_SET_MODE, mode) < 0) {
+    perror("ioctl.GBLFIFO_SET_MODE");
+    exit(1);
+  }
+
+  memset(written, 0, sizeof(written));
+  memset(last, 0, sizeof(last));
+  out_of_order = 0;
+  stop = done = 0;
+  pthread_create(&ctid, NULL, consumer, NULL);
+  for (int i = 0; i < nr; i++)
+    pthread_create(&tids[i], NULL, producer, (void *)(long)i);
+
+  long long start = now_ns();
+  struct timespec d = {DURATION_NS / 1000000000LL,
+      DURATION_NS % 1000000000LL};
+  nanosleep(&d, NULL);
+  stop = 1;
+  long long elapsed = now_ns() - start;
+  for (int i = 0; i < nr; i++) {
+    pthread_join(tids[i], NULL);
+    msgs += written[i];
+  }
+  done = 1;
+  pthread_join(ctid, NULL);
+
+  close(rfd);
+  close(wfd);
+  ioctl(ctl, GBLFIFO_CTL_DESTROY, minor);
+
+  printf("%s,%d,%.0f,%.1f,%lld\n", name, nr, msgs * 1e9 / elapsed,
+      msgs * MSG * 1e3 / elapsed, out_of_order);
+}
+
+/* producer counts double, and the last run uses every CPU */
+static int next_count(int nr, int cpus) {
+  if (nr < cpus && nr * 2 > cpus) return cpus;
+  return nr * 2;
+}
+
+int main(int argc, const char *argv[]) {
+  static const struct {
+    const char *name;
+    unsigned mode;
+  } modes[] = {
+      {"mutex", GBLFIFO_MODE_RECORD},
+      {"percpu", GBLFIFO_MODE_RECORD | GBLFIFO_MODE_PERCPU},
+      {"ordered",
+          GBLFIFO_MODE_RECORD | GBLFIFO_MODE_PERCPU | GBLFIFO_MODE_ORDERED},
+  };
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (argc < 2) {
+    printf("need gblfifo_ctl cdev file\n");
+    return 0;
+  }
+
+  int ctl = open(argv[1], O_RDWR);
+  if (ctl < 0) {
+    perror("open");
+    return 0;
+  }
+  if (cpus > MAX_PRODUCERS) cpus = MAX_PRODUCERS;
+
+  printf("mode,producers,msgs_per_sec,mb_per_sec,out_of_order\n");
+  for (unsigned k = 0; k < sizeof(modes) / sizeof(modes[0]); k++) {
+    for (int nr = 1; nr <= cpus; nr = next_count(nr, cpus))
+      bench(ctl, modes[k].name, modes[k].mode, nr);
+  }
+
+  close(ctl);
+  return 0;
+}
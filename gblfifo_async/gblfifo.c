@@ -1,189 +1,2355 @@
+#include <linux/capability.h>
 #include <linux/cdev.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/file.h>
+#include <linux/idr.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/major.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/percpu-rwsem.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/timer.h>
+#include <linux/topology.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
-#define FIFO_CLEAR 1
-#define GBLFIFO_MAJOR 230
+#include "gblfifo.h"
+#include "gblfifo_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "gblfifo_trace.h"
+
+#define GBLFIFO_MAX_DEVS 256
 #define GBLFIFO_SIZE 1024
+#define GBLFIFO_MIN_SIZE 64
+#define GBLFIFO_MAX_SIZE (64U << 20)
+#define GBLFIFO_LANE_SIZE 4096
+#define GBLFIFO_BULK_WEIGHT 8
+#define GBLFIFO_MAX_MARKS (1U << 16) /* 1 MiB of marks per lane at most */
+#define GBLFIFO_SPILL_CHUNK (64U << 10)
+#define GBLFIFO_SHARD_SIZE 4096
+
+static unsigned ring_size = GBLFIFO_SIZE;
+module_param_named(size, ring_size, uint, 0444);
+MODULE_PARM_DESC(size, "initial ring size in bytes, rounded to a power of two");
+
+static unsigned lane_size = GBLFIFO_LANE_SIZE;
+module_param(lane_size, uint, 0444);
+MODULE_PARM_DESC(lane_size, "bytes in each priority lane, as for size");
+
+static unsigned shard_size = GBLFIFO_SHARD_SIZE;
+module_param(shard_size, uint, 0444);
+MODULE_PARM_DESC(shard_size, "bytes in each CPU's ring in percpu mode");
+
+static bool tstamp = true;
+module_param(tstamp, bool, 0644);
+MODULE_PARM_DESC(tstamp, "stamp writes for residency stats and RECV_BATCH_TS");
+
+static unsigned nr_devs = 1;
+module_param(nr_devs, uint, 0444);
+MODULE_PARM_DESC(nr_devs, "instances created at load, more via gblfifo_ctl");
 
 #define klog(fmt, ...) \
   printk(KERN_INFO "%s:%d: " fmt, __func__, __LINE__, ##__VA_ARGS__)
 
+/*
+ * head and tail run freely, head - tail is the number of queued bytes. They
+ * live in the shm page, which is mapped to userspace in front of mem. In
+ * broadcast mode tail trails the slowest reader's cursor. mem is replaced
+ * on resize while shm stays put, so lockless wait conditions never touch
+ * freed memory.
+ */
+/* a write that ended at end was queued at ns, see gblfifo_lane_stats */
+struct gblfifo_mark {
+  unsigned end;
+  unsigned nr; /* writes merged into it while the array was full */
+  u64 ns;
+};
+
+/*
+ * Lane 0 is the ring behind shm, only its marks and counters live here.
+ * Priority lanes are kernel-only rings of lane_size bytes holding u32
+ * length prefixed messages, head and tail run freely like the ring's.
+ */
+struct gblfifo_lane {
+  uint8_t *mem;
+  unsigned head, tail;
+  unsigned high_water;
+  struct gblfifo_mark *marks; /* see gblfifo_alloc_marks */
+  unsigned nr_marks;          /* a power of two */
+  unsigned mark_head, mark_tail;
+  u64 msgs, wait_ns, max_wait_ns;
+  u64 hist[GBLFIFO_HIST_BUCKETS]; /* msgs by log2 of their wait */
+  u64 merged[GBLFIFO_HIST_BUCKETS]; /* of those, timed from an older write */
+};
+
+/*
+ * The file a full ring overflows into. What waits here sits in [rd, wr) of
+ * the file, then in wbuf[wbuf_rd, wbuf_len) on its way to the file, then
+ * in buf[buf_rd, buf_len), and goes back into the ring in that order.
+ * Writers don't touch the ring while len != 0 or spill_work is busy, so
+ * these bytes take the ring positions right after head.
+ */
+struct gblfifo_spill_file {
+  struct file *filp;
+  uint8_t *buf, *wbuf; /* chunk bytes each, at least a ring's worth */
+  size_t chunk, buf_rd, buf_len, wbuf_rd, wbuf_len;
+  loff_t rd, wr;
+  u64 max_bytes, len, high_water, spilled;
+  int err; /* from the file, spilling stops until a clear */
+  bool busy;           /* spill_work is in the file without the mutex */
+  unsigned nr_waiting; /* writers waiting for wbuf to be written */
+  unsigned gen;        /* bumped by a clear */
+};
+
+/*
+ * A CPU's ring in percpu mode, allocated on its node. Writers running
+ * there append under lock, readers take records off under devp->mutex,
+ * head and tail run freely. In ordered mode each record's u32 length is
+ * followed by its u64 sequence number.
+ */
+struct gblfifo_shard {
+  struct mutex lock;
+  unsigned head;
+  unsigned cpu;
+  u64 msgs;
+  unsigned tail ____cacheline_aligned_in_smp; /* the readers' side */
+  uint8_t mem[];
+};
+
 struct gblfifo_dev {
-  unsigned curl;
-  struct cdev cdev;
+  struct gblfifo_shm *shm;
+  uint8_t *mem;
+  unsigned size; /* a power of two, shm->size is only a copy for userspace */
+  unsigned high_water;
+  u64 full_waits;
+  u64 dropped_bytes, dropped_records;
+  struct dentry *debugfs;
+  unsigned mode;
+  atomic_t nr_maps;
+  struct list_head readers;
+  struct list_head files;
+  int minor;
+  unsigned nr_open; /* protected by gblfifo_idr_lock */
+  /* watermark range over the open files, see gblfifo_update_lowat */
+  unsigned rcvlowat_min, rcvlowat_max;
+  unsigned sndlowat_min, sndlowat_max;
+  unsigned nr_timed;
+  /* blocked reads and writes, see struct gblfifo_sleeper */
+  struct list_head rcv_sleepers, snd_sleepers;
+  unsigned rcv_sleep_min, snd_sleep_min;
   struct mutex mutex;
   wait_queue_head_t r_wait;
   wait_queue_head_t w_wait;
   struct fasync_struct *async_queue;
-  uint8_t mem[GBLFIFO_SIZE];
+  /* SIGIO coalescing, see struct gblfifo_sigio */
+  struct gblfifo_sigio sigio;
+  unsigned long sigio_last;
+  u64 sigio_bytes;
+  struct gblfifo_lane lanes[GBLFIFO_NR_LANES];
+  unsigned lane_size;
+  /* reads that went to a priority lane while lane 0 had data too */
+  unsigned bulk_weight, bulk_skips;
+  struct gblfifo_spill_file *spill; /* NULL unless GBLFIFO_SET_SPILL */
+  struct work_struct spill_work;    /* refills the ring from it */
+  /* percpu mode, see struct gblfifo_shard */
+  struct gblfifo_shard **shards; /* by CPU, from the first switch on */
+  unsigned shard_size;
+  unsigned shard_next; /* where relaxed readers look first */
+  u64 next_seq;        /* what ordered readers hand out next */
+  /* held for reading by shard writers, for writing by mode switches */
+  struct percpu_rw_semaphore shard_sem;
+  atomic64_t seq ____cacheline_aligned_in_smp; /* ordered writers' numbers */
+};
+
+/*
+ * A read or write blocked in a non-exclusive wait, on its own stack. A
+ * read of len bytes waits for min(rcvlowat, len) and a write for what it
+ * has to queue in one go, so publish and consume look at the smallest of
+ * those as well as at the watermarks that pollers wait for.
+ */
+struct gblfifo_sleeper {
+  struct list_head node;
+  unsigned target;
+};
+
+/* per open file state, cursor is only used in broadcast mode */
+struct gblfifo_file {
+  struct gblfifo_dev *devp;
+  struct list_head node;  /* on devp->readers */
+  struct list_head entry; /* on devp->files */
+  fmode_t fmode;
+  unsigned lane; /* where writes go */
+  unsigned cursor;
+  bool lagged;
+  unsigned rcvlowat, sndlowat, timeout_ms;
+  /* fires timeout_ms after data below rcvlowat was first seen */
+  struct timer_list timer;
+  bool expired;
 };
 
-static struct gblfifo_dev *gblfifo_devp = NULL;
+/*
+ * Instances by minor. The lock only covers lookup, creation and teardown,
+ * everything else is under the instance's own mutex.
+ */
+static DEFINE_IDR(gblfifo_idr);
+static DEFINE_MUTEX(gblfifo_idr_lock);
+static dev_t gblfifo_devt;
+static struct cdev gblfifo_cdev;
+static struct class *gblfifo_class;
+static struct dentry *gblfifo_debugfs;
+
+static unsigned gblfifo_size(struct gblfifo_dev *devp) {
+  return READ_ONCE(devp->size);
+}
+
+/* acquire pairs with the release of the index by the other side */
+static unsigned gblfifo_len(struct gblfifo_dev *devp) {
+  unsigned tail = smp_load_acquire(&devp->shm->tail);
+
+  return gblfifo_used(smp_load_acquire(&devp->shm->head), tail,
+      gblfifo_size(devp));
+}
+
+static unsigned gblfifo_room(struct gblfifo_dev *devp) {
+  return gblfifo_size(devp) - gblfifo_len(devp);
+}
+
+static bool gblfifo_broadcast(struct gblfifo_dev *devp) {
+  return READ_ONCE(devp->mode) & GBLFIFO_MODE_BROADCAST;
+}
+
+/*
+ * in record mode every write is queued as a u32 length followed by the
+ * payload, so cursors and tail always sit on a record boundary
+ */
+static bool gblfifo_record(struct gblfifo_dev *devp) {
+  return READ_ONCE(devp->mode) & GBLFIFO_MODE_RECORD;
+}
+
+/* where the next read of this file starts */
+static unsigned gblfifo_rpos(struct gblfifo_file *fp) {
+  if (gblfifo_broadcast(fp->devp)) return READ_ONCE(fp->cursor);
+  return READ_ONCE(fp->devp->shm->tail);
+}
+
+/* bytes this file can read */
+static unsigned gblfifo_avail(struct gblfifo_file *fp) {
+  struct gblfifo_dev *devp = fp->devp;
+  unsigned pos, len;
+
+  if (!gblfifo_broadcast(devp)) return gblfifo_len(devp);
+
+  pos = READ_ONCE(fp->cursor);
+  len = smp_load_acquire(&devp->shm->head) - pos;
+  return min_t(unsigned, len, gblfifo_size(devp));
+}
+
+/* lockless like gblfifo_len, head is released by the writer */
+static unsigned gblfifo_lane_len(struct gblfifo_dev *devp, unsigned lane) {
+  struct gblfifo_lane *l = &devp->lanes[lane];
+  unsigned tail = READ_ONCE(l->tail);
+
+  if (lane == 0) return gblfifo_len(devp);
+  return gblfifo_used(smp_load_acquire(&l->head), tail, devp->lane_size);
+}
+
+static unsigned gblfifo_lane_room(struct gblfifo_dev *devp, unsigned lane) {
+  return devp->lane_size - gblfifo_lane_len(devp, lane);
+}
+
+/* bytes queued in the priority lanes */
+static unsigned gblfifo_prio_len(struct gblfifo_dev *devp) {
+  unsigned i, len = 0;
+
+  for (i = 1; i < GBLFIFO_NR_LANES; i++) len += gblfifo_lane_len(devp, i);
+  return len;
+}
+
+/* data is waiting in the spill file, called with mutex held */
+static bool gblfifo_spilling(struct gblfifo_dev *devp) {
+  return devp->spill && devp->spill->len;
+}
+
+static bool gblfifo_percpu(struct gblfifo_dev *devp) {
+  return READ_ONCE(devp->mode) & GBLFIFO_MODE_PERCPU;
+}
+
+static bool gblfifo_ordered(struct gblfifo_dev *devp) {
+  return READ_ONCE(devp->mode) & GBLFIFO_MODE_ORDERED;
+}
+
+/* bytes in front of a shard record's payload */
+static unsigned gblfifo_shard_hdr(struct gblfifo_dev *devp) {
+  return GBLFIFO_REC_HDR + (gblfifo_ordered(devp) ? sizeof(u64) : 0);
+}
+
+/* lockless like gblfifo_len */
+static unsigned gblfifo_shard_len(
+    struct gblfifo_dev *devp, struct gblfifo_shard *sh) {
+  unsigned tail = READ_ONCE(sh->tail);
+
+  return gblfifo_used(smp_load_acquire(&sh->head), tail, devp->shard_size);
+}
+
+static unsigned gblfifo_shard_room(
+    struct gblfifo_dev *devp, struct gblfifo_shard *sh) {
+  return devp->shard_size - gblfifo_shard_len(devp, sh);
+}
+
+/* the sequence number of the ordered record at pos */
+static u64 gblfifo_shard_seq(
+    struct gblfifo_dev *devp, struct gblfifo_shard *sh, unsigned pos) {
+  pos += GBLFIFO_REC_HDR;
+  return gblfifo_mem_peek_hdr(sh->mem, devp->shard_size, pos) |
+         (u64)gblfifo_mem_peek_hdr(sh->mem, devp->shard_size, pos + 4) << 32;
+}
+
+/*
+ * The shard a read takes its record from, NULL if none. In relaxed mode
+ * that's the first non-empty one from shard_next on, so no CPU starves the
+ * others. In ordered mode it's the one holding the lowest number, unless
+ * a writer still has to publish a lower one. Numbers below next_seq only
+ * show up after a FIFO_CLEAR raced with a writer, they go out right away.
+ * Safe without the mutex, the answer may just be stale.
+ */
+static struct gblfifo_shard *gblfifo_shard_pick(struct gblfifo_dev *devp) {
+  struct gblfifo_shard **shards = READ_ONCE(devp->shards);
+  struct gblfifo_shard *sh, *best = NULL;
+  unsigned i, start = READ_ONCE(devp->shard_next);
+  u64 seq, best_seq = U64_MAX;
+
+  if (!shards) return NULL;
+  for (i = 0; i < nr_cpu_ids; i++) {
+    sh = shards[(start + i) % nr_cpu_ids];
+    if (!sh || gblfifo_shard_len(devp, sh) == 0) continue;
+    if (!gblfifo_ordered(devp)) return sh;
+    seq = gblfifo_shard_seq(devp, sh, READ_ONCE(sh->tail));
+    if (seq < best_seq) {
+      best = sh;
+      best_seq = seq;
+    }
+  }
+  if (best && best_seq > READ_ONCE(devp->next_seq)) return NULL;
+  return best;
+}
+
+/*
+ * Marks for a ring of size bytes, one per smallest record it holds, so
+ * records and lane messages each get their own unless GBLFIFO_MAX_MARKS
+ * caps it. Stream writes shorter than a record can still run out of them.
+ */
+static struct gblfifo_mark *gblfifo_alloc_marks(unsigned size, unsigned *nr) {
+  *nr = min_t(unsigned long,
+      roundup_pow_of_two(size / (GBLFIFO_REC_HDR + 1)), GBLFIFO_MAX_MARKS);
+  return kvcalloc(*nr, sizeof(struct gblfifo_mark), GFP_KERNEL);
+}
+
+/*
+ * Hand the pending marks over to a new array, called with mutex held. The
+ * indices keep their values like head and tail do. If they don't fit, the
+ * newest ones are merged the way gblfifo_mark merges.
+ */
+static void gblfifo_move_marks(
+    struct gblfifo_lane *l, struct gblfifo_mark *marks, unsigned nr) {
+  unsigned n = l->mark_head - l->mark_tail, i, k;
+  struct gblfifo_mark *m, *last = NULL;
+
+  for (i = 0; i < n; i++) {
+    k = l->mark_tail + i;
+    m = &l->marks[k & (l->nr_marks - 1)];
+    if (i < nr) {
+      last = &marks[k & (nr - 1)];
+      *last = *m;
+    } else {
+      last->end = m->end;
+      last->nr += m->nr;
+    }
+  }
+  if (n > nr) l->mark_head = l->mark_tail + nr;
+  kvfree(l->marks);
+  l->marks = marks;
+  l->nr_marks = nr;
+}
+
+/* remember when the write ending at end went in, called with mutex held */
+static void gblfifo_mark(struct gblfifo_lane *l, unsigned end) {
+  struct gblfifo_mark *m;
+
+  if (!READ_ONCE(tstamp)) return;
+  if (l->mark_head - l->mark_tail == l->nr_marks) {
+    /* the newest mark takes this write too and keeps its older time */
+    m = &l->marks[(l->mark_head - 1) & (l->nr_marks - 1)];
+    m->end = end;
+    m->nr++;
+    return;
+  }
+  m = &l->marks[l->mark_head++ & (l->nr_marks - 1)];
+  m->end = end;
+  m->nr = 1;
+  m->ns = ktime_get_ns();
+}
+
+/* account the writes tail has moved past, called with mutex held */
+static void gblfifo_retire(struct gblfifo_lane *l, unsigned tail) {
+  struct gblfifo_mark *m;
+  u64 now, wait;
+  unsigned b;
+
+  if (l->mark_tail == l->mark_head) return;
+
+  now = ktime_get_ns();
+  while (l->mark_tail != l->mark_head) {
+    m = &l->marks[l->mark_tail & (l->nr_marks - 1)];
+    if ((int)(tail - m->end) < 0) break;
+    wait = now - m->ns;
+    b = gblfifo_hist_bucket(wait);
+    l->msgs += m->nr;
+    l->wait_ns += wait * m->nr;
+    l->max_wait_ns = max(l->max_wait_ns, wait);
+    l->hist[b] += m->nr;
+    l->merged[b] += m->nr - 1;
+    l->mark_tail++;
+  }
+}
+
+/*
+ * When the message ending at end was written, 0 if that is not known. *k is
+ * a mark index that only moves forward, for walking a run of messages.
+ */
+static u64 gblfifo_stamp(struct gblfifo_lane *l, unsigned *k, unsigned end) {
+  struct gblfifo_mark *m;
+
+  for (; *k != l->mark_head; (*k)++) {
+    m = &l->marks[*k & (l->nr_marks - 1)];
+    if ((int)(m->end - end) >= 0) return m->ns;
+  }
+  return 0;
+}
+
+/* drop everything queued on the priority lanes, called with mutex held */
+static void gblfifo_clear_lanes(struct gblfifo_dev *devp) {
+  struct gblfifo_lane *l;
+
+  for (l = devp->lanes; l < devp->lanes + GBLFIFO_NR_LANES; l++) {
+    /* catch tail up rather than zero both, lockless readers see no wrap */
+    smp_store_release(&l->tail, l->head);
+    l->high_water = 0;
+    l->mark_tail = l->mark_head;
+    l->msgs = l->wait_ns = l->max_wait_ns = 0;
+    memset(l->hist, 0, sizeof(l->hist));
+    memset(l->merged, 0, sizeof(l->merged));
+  }
+  devp->bulk_skips = 0;
+}
+
+/* move tail up to the slowest reader, called with mutex held */
+static void gblfifo_update_tail(struct gblfifo_dev *devp) {
+  unsigned head = devp->shm->head, backlog = 0;
+  struct gblfifo_file *fp;
+
+  list_for_each_entry(fp, &devp->readers, node) {
+    backlog = max(backlog, head - fp->cursor);
+  }
+  smp_store_release(&devp->shm->tail, head - backlog);
+}
+
+/* skip the readers that leave less than need bytes, called with mutex held */
+static bool gblfifo_drop_lagging(struct gblfifo_dev *devp, size_t need) {
+  unsigned head = devp->shm->head;
+  struct gblfifo_file *fp;
+  bool dropped = false;
+
+  list_for_each_entry(fp, &devp->readers, node) {
+    if (head - fp->cursor <= devp->size - need) continue;
+    WRITE_ONCE(fp->cursor, head);
+    WRITE_ONCE(fp->lagged, true);
+    dropped = true;
+  }
+
+  if (dropped) {
+    gblfifo_update_tail(devp);
+    wake_up_interruptible_all(&devp->r_wait);
+  }
+  return dropped;
+}
+
+/* recompute the watermark range, called with mutex held */
+static void gblfifo_update_lowat(struct gblfifo_dev *devp) {
+  unsigned rmin = UINT_MAX, rmax = 1, smin = UINT_MAX, smax = 1;
+  struct gblfifo_file *fp;
+
+  devp->nr_timed = 0;
+  list_for_each_entry(fp, &devp->files, entry) {
+    if (fp->fmode & FMODE_READ) {
+      rmin = min(rmin, fp->rcvlowat);
+      rmax = max(rmax, fp->rcvlowat);
+      if (fp->timeout_ms) devp->nr_timed++;
+    }
+    if (fp->fmode & FMODE_WRITE) {
+      smin = min(smin, fp->sndlowat);
+      smax = max(smax, fp->sndlowat);
+    }
+  }
+  devp->rcvlowat_min = min(rmin, rmax);
+  devp->rcvlowat_max = rmax;
+  devp->sndlowat_min = min(smin, smax);
+  devp->sndlowat_max = smax;
+}
+
+/*
+ * whether going from prev to now bytes can satisfy a sleeper whose
+ * watermark lies in [lo, hi]; with the default of 1 this is the
+ * empty -> non-empty transition
+ */
+static bool gblfifo_crossed(
+    unsigned prev, unsigned now, unsigned lo, unsigned hi) {
+  return prev < hi && now >= lo;
+}
+
+/* called with mutex held, around the wait */
+static void gblfifo_add_sleeper(
+    struct list_head *list, unsigned *lo, struct gblfifo_sleeper *s) {
+  list_add(&s->node, list);
+  *lo = min(*lo, s->target);
+}
+
+static void gblfifo_del_sleeper(
+    struct list_head *list, unsigned *lo, struct gblfifo_sleeper *s) {
+  list_del(&s->node);
+  if (s->target != *lo) return;
+  *lo = UINT_MAX;
+  list_for_each_entry(s, list, node) *lo = min(*lo, s->target);
+}
+
+/*
+ * a sleeper with a watermark of its own might not be able to use a wakeup,
+ * so only default sleepers wait exclusively and get handed one
+ */
+static bool gblfifo_rcv_exclusive(struct gblfifo_file *fp) {
+  return fp->rcvlowat == 1 && !fp->timeout_ms;
+}
+
+/*
+ * a write of up to PIPE_BUF bytes waits for all of it, and record writes for
+ * a header more, so a writer can only take any wakeup when it needs a byte
+ */
+static bool gblfifo_snd_exclusive(size_t need) {
+  return need == 1;
+}
+
+static void gblfifo_lowat_timeout(struct timer_list *t) {
+  struct gblfifo_file *fp = from_timer(fp, t, timer);
+
+  WRITE_ONCE(fp->expired, true);
+  wake_up_interruptible_poll(&fp->devp->r_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* bytes a blocking read of len bytes waits for */
+static unsigned gblfifo_rcv_target(struct gblfifo_file *fp, size_t len) {
+  if (gblfifo_record(fp->devp)) return fp->rcvlowat;
+  return min_t(size_t, fp->rcvlowat, len);
+}
+
+/* data below the watermark is let through once the timer has fired */
+static bool gblfifo_bulk_ready(struct gblfifo_file *fp, unsigned target) {
+  unsigned avail = gblfifo_avail(fp);
+
+  /* nothing goes into the ring, and no watermark holds a shard back */
+  if (gblfifo_percpu(fp->devp)) return gblfifo_shard_pick(fp->devp) != NULL;
+  return avail >= target || READ_ONCE(fp->lagged) ||
+         (avail && READ_ONCE(fp->expired));
+}
+
+/* priority messages don't wait for any watermark */
+static bool gblfifo_ready(struct gblfifo_file *fp, unsigned target) {
+  return gblfifo_prio_len(fp->devp) != 0 || gblfifo_bulk_ready(fp, target);
+}
+
+/* anything at all for this reader, whatever the watermarks say */
+static bool gblfifo_pending(struct gblfifo_file *fp) {
+  struct gblfifo_dev *devp = fp->devp;
+
+  return gblfifo_avail(fp) || gblfifo_prio_len(devp) ||
+         (gblfifo_percpu(devp) && gblfifo_shard_pick(devp));
+}
+
+/* data below the watermark showed up and the clock is not running yet */
+static bool gblfifo_want_timer(struct gblfifo_file *fp, unsigned target) {
+  unsigned avail = gblfifo_avail(fp);
+  return fp->timeout_ms && avail && avail < target &&
+         !READ_ONCE(fp->expired) && !timer_pending(&fp->timer);
+}
+
+static void gblfifo_arm_timer(struct gblfifo_file *fp, unsigned target) {
+  if (gblfifo_want_timer(fp, target))
+    mod_timer(&fp->timer, jiffies + msecs_to_jiffies(fp->timeout_ms));
+}
+
+/* the next batch starts a new max-wait period */
+static void gblfifo_reset_timer(struct gblfifo_file *fp) {
+  del_timer_sync(&fp->timer);
+  WRITE_ONCE(fp->expired, false);
+}
+
+static void gblfifo_consume(struct gblfifo_file *fp, unsigned len) {
+  struct gblfifo_dev *devp = fp->devp;
+  unsigned tail = devp->shm->tail;
+  unsigned room = gblfifo_room(devp);
+  unsigned pos = gblfifo_rpos(fp);
+
+  if (fp->timeout_ms) gblfifo_reset_timer(fp);
+
+  if (gblfifo_broadcast(devp)) {
+    WRITE_ONCE(fp->cursor, fp->cursor + len);
+    gblfifo_update_tail(devp);
+  } else {
+    smp_store_release(&devp->shm->tail, tail + len);
+  }
+  gblfifo_retire(&devp->lanes[0], devp->shm->tail);
+  trace_gblfifo_dequeue(devp->minor, 0, pos, len, gblfifo_avail(fp));
+
+  /* a broadcast reader that is not the slowest frees nothing */
+  if (devp->shm->tail == tail) return;
+
+  /* the room goes to what overflowed into the spill file first */
+  if (gblfifo_spilling(devp)) schedule_work(&devp->spill_work);
+
+  /*
+   * a poller waits for its sndlowat worth of room and a blocked write for
+   * what it queues in one go, but a record writer may need more room than
+   * was free, so it has to look after every read
+   */
+  if (gblfifo_record(devp) ||
+      gblfifo_crossed(room, gblfifo_room(devp),
+          devp->sndlowat_min, devp->sndlowat_max) ||
+      gblfifo_room(devp) >= devp->snd_sleep_min)
+    wake_up_interruptible_poll(&devp->w_wait, EPOLLOUT | EPOLLWRNORM);
+  if (room == 0 && devp->async_queue)
+    kill_fasync(&devp->async_queue, SIGIO, POLL_OUT);
+
+  /* pass the wakeup on if there is something left for another reader */
+  if (!gblfifo_broadcast(devp) &&
+      (gblfifo_len(devp) != 0 || gblfifo_prio_len(devp) != 0) &&
+      wq_has_sleeper(&devp->r_wait))
+    wake_up_interruptible_poll(&devp->r_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+static int gblfifo_open(struct inode *inode, struct file *filp) {
+  struct gblfifo_file *fp = kzalloc(sizeof(*fp), GFP_KERNEL);
+  if (!fp) return -ENOMEM;
+
+  /* an open instance can't be destroyed */
+  mutex_lock(&gblfifo_idr_lock);
+  fp->devp = idr_find(&gblfifo_idr, iminor(inode));
+  if (fp->devp) fp->devp->nr_open++;
+  mutex_unlock(&gblfifo_idr_lock);
+  if (!fp->devp) {
+    kfree(fp);
+    return -ENODEV;
+  }
+
+  INIT_LIST_HEAD(&fp->node);
+  /* read_iter/write_iter honor IOCB_NOWAIT */
+  filp->f_mode |= FMODE_NOWAIT;
+  fp->fmode = filp->f_mode;
+  fp->rcvlowat = fp->sndlowat = 1;
+  timer_setup(&fp->timer, gblfifo_lowat_timeout, 0);
+
+  mutex_lock(&fp->devp->mutex);
+  if (filp->f_mode & FMODE_READ) {
+    fp->cursor = fp->devp->shm->head;
+    list_add_tail(&fp->node, &fp->devp->readers);
+  }
+  list_add_tail(&fp->entry, &fp->devp->files);
+  gblfifo_update_lowat(fp->devp);
+  mutex_unlock(&fp->devp->mutex);
+
+  filp->private_data = fp;
+  return 0;
+}
+
+static size_t gblfifo_copy_to_iter(
+    struct gblfifo_dev *devp, unsigned pos, size_t len, struct iov_iter *to) {
+  return gblfifo_mem_copy_to_iter(devp->mem, devp->size, pos, len, to);
+}
+
+static size_t gblfifo_copy_from_iter(
+    struct gblfifo_dev *devp, unsigned pos, size_t len, struct iov_iter *from) {
+  return gblfifo_mem_copy_from_iter(devp->mem, devp->size, pos, len, from);
+}
+
+static u32 gblfifo_peek_hdr(struct gblfifo_dev *devp, unsigned pos) {
+  return gblfifo_mem_peek_hdr(devp->mem, devp->size, pos);
+}
+
+static void gblfifo_poke_hdr(struct gblfifo_dev *devp, unsigned pos, u32 hdr) {
+  gblfifo_mem_poke_hdr(devp->mem, devp->size, pos, hdr);
+}
+
+static bool gblfifo_overwrite(struct gblfifo_dev *devp) {
+  return READ_ONCE(devp->mode) & GBLFIFO_MODE_OVERWRITE;
+}
+
+/* make room for need bytes by dropping the oldest data, mutex held */
+static void gblfifo_drop_oldest(struct gblfifo_dev *devp, size_t need) {
+  unsigned head = devp->shm->head, tail = devp->shm->tail;
+  u32 rec_len;
+
+  if (gblfifo_room(devp) >= need) return;
+
+  if (gblfifo_record(devp)) {
+    /* whole records only, so tail stays on a record boundary */
+    while (devp->size - (head - tail) < need) {
+      rec_len = gblfifo_peek_hdr(devp, tail);
+      tail += GBLFIFO_REC_HDR + rec_len;
+      devp->dropped_bytes += rec_len;
+      devp->dropped_records++;
+    }
+  } else {
+    tail = head - (devp->size - need);
+    devp->dropped_bytes += tail - devp->shm->tail;
+  }
+  smp_store_release(&devp->shm->tail, tail);
+  gblfifo_retire(&devp->lanes[0], tail);
+}
+
+/*
+ * Wait conditions, evaluated after the waiter is queued. Raising the
+ * *_waiting flag there tells a peer on the shared mapping to kick us.
+ */
+static bool gblfifo_readable(struct gblfifo_file *fp, unsigned target) {
+  WRITE_ONCE(fp->devp->shm->r_waiting, 1);
+  smp_mb();
+  /* come back out to start the max-wait clock */
+  return gblfifo_ready(fp, target) || gblfifo_want_timer(fp, target);
+}
+
+static bool gblfifo_writable(struct gblfifo_dev *devp, size_t need) {
+  WRITE_ONCE(devp->shm->w_waiting, 1);
+  smp_mb();
+  /* a shrink may leave a record that never fits, let the caller fail it */
+  return gblfifo_room(devp) >= need || need > gblfifo_size(devp) ||
+         READ_ONCE(devp->spill);
+}
+
+/* the lock orders us against a waiter queueing itself and raising the flag */
+static void gblfifo_clear_waiting(wait_queue_head_t *wq, u32 *flag) {
+  spin_lock_irq(&wq->lock);
+  if (!waitqueue_active(wq)) WRITE_ONCE(*flag, 0);
+  spin_unlock_irq(&wq->lock);
+}
+
+/*
+ * O_NONBLOCK, or an io_uring or RWF_NOWAIT request that must not sleep at
+ * all, so io_uring can arm poll and retry instead of punting to a worker
+ */
+static bool gblfifo_nowait(struct kiocb *iocb) {
+  return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+         (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static int gblfifo_lock(struct gblfifo_dev *devp, struct kiocb *iocb) {
+  if (!(iocb->ki_flags & IOCB_NOWAIT)) {
+    mutex_lock(&devp->mutex);
+    return 0;
+  }
+  return mutex_trylock(&devp->mutex) ? 0 : -EAGAIN;
+}
+
+/* wait for target bytes, called and returns with mutex held */
+static int gblfifo_wait_readable(
+    struct gblfifo_file *fp, unsigned target, bool nonblock) {
+  struct gblfifo_dev *devp = fp->devp;
+  struct gblfifo_sleeper me = {.target = target};
+  int ret;
+
+  while (!gblfifo_ready(fp, target)) {
+    if (nonblock) {
+      if (!gblfifo_pending(fp)) return -EAGAIN;
+      return 0;
+    }
+
+    gblfifo_arm_timer(fp, target);
+    trace_gblfifo_block(devp->minor, false, target, gblfifo_avail(fp));
+    /* exclusive, so a write wakes one reader instead of the whole herd */
+    if (gblfifo_rcv_exclusive(fp)) {
+      mutex_unlock(&devp->mutex);
+      ret = wait_event_interruptible_exclusive(
+          devp->r_wait, gblfifo_readable(fp, target));
+      gblfifo_clear_waiting(&devp->r_wait, &devp->shm->r_waiting);
+      mutex_lock(&devp->mutex);
+    } else {
+      gblfifo_add_sleeper(&devp->rcv_sleepers, &devp->rcv_sleep_min, &me);
+      mutex_unlock(&devp->mutex);
+      ret = wait_event_interruptible(
+          devp->r_wait, gblfifo_readable(fp, target));
+      gblfifo_clear_waiting(&devp->r_wait, &devp->shm->r_waiting);
+      mutex_lock(&devp->mutex);
+      gblfifo_del_sleeper(&devp->rcv_sleepers, &devp->rcv_sleep_min, &me);
+    }
+    trace_gblfifo_wake(devp->minor, false, ret);
+
+    if (ret) return ret;
+  }
+  return 0;
+}
+
+/* wait for room for need bytes, called and returns with mutex held */
+static int gblfifo_wait_writable(
+    struct gblfifo_file *fp, size_t need, bool nonblock) {
+  struct gblfifo_dev *devp = fp->devp;
+  struct gblfifo_sleeper me = {.target = need};
+  int ret;
+
+  if (gblfifo_overwrite(devp)) {
+    if (need > devp->size) return -EMSGSIZE;
+    gblfifo_drop_oldest(devp, need);
+    return 0;
+  }
+
+  /* with a spill file set the write goes there instead of waiting */
+  if (gblfifo_room(devp) < need && !devp->spill) devp->full_waits++;
+
+  while (gblfifo_room(devp) < need && !devp->spill) {
+    if (need > devp->size) return -EMSGSIZE;
+
+    if ((devp->mode & GBLFIFO_MODE_DROP_LAGGING) && gblfifo_broadcast(devp) &&
+        gblfifo_drop_lagging(devp, need))
+      continue;
+
+    if (nonblock) return -EAGAIN;
+
+    trace_gblfifo_block(devp->minor, true, need, gblfifo_room(devp));
+    if (gblfifo_snd_exclusive(need)) {
+      mutex_unlock(&devp->mutex);
+      ret = wait_event_interruptible_exclusive(
+          devp->w_wait, gblfifo_writable(devp, need));
+      gblfifo_clear_waiting(&devp->w_wait, &devp->shm->w_waiting);
+      mutex_lock(&devp->mutex);
+    } else {
+      gblfifo_add_sleeper(&devp->snd_sleepers, &devp->snd_sleep_min, &me);
+      mutex_unlock(&devp->mutex);
+      ret = wait_event_interruptible(
+          devp->w_wait, gblfifo_writable(devp, need));
+      gblfifo_clear_waiting(&devp->w_wait, &devp->shm->w_waiting);
+      mutex_lock(&devp->mutex);
+      gblfifo_del_sleeper(&devp->snd_sleepers, &devp->snd_sleep_min, &me);
+    }
+    trace_gblfifo_wake(devp->minor, true, ret);
+
+    if (ret) return ret;
+  }
+  return 0;
+}
+
+/* report a gap once, then carry on from where the writer put us */
+static int gblfifo_check_lagged(struct gblfifo_file *fp) {
+  if (!fp->lagged) return 0;
+  fp->lagged = false;
+  return -EPIPE;
+}
+
+/*
+ * The lane a read is served from: the highest one with data, except that
+ * once bulk_weight reads went past lane 0 while bulk says it had something
+ * for this reader, it gets the next one. Called with mutex held.
+ */
+static unsigned gblfifo_pick_lane(struct gblfifo_file *fp, bool bulk) {
+  struct gblfifo_dev *devp = fp->devp;
+  unsigned i;
+
+  for (i = GBLFIFO_NR_LANES - 1; i > 0; i--) {
+    if (gblfifo_lane_len(devp, i) == 0) continue;
+    if (bulk && devp->bulk_weight && devp->bulk_skips >= devp->bulk_weight)
+      break;
+    if (bulk) devp->bulk_skips++;
+    return i;
+  }
+  devp->bulk_skips = 0;
+  return 0;
+}
+
+static void gblfifo_consume_lane(
+    struct gblfifo_dev *devp, unsigned lane, unsigned len) {
+  struct gblfifo_lane *l = &devp->lanes[lane];
+  unsigned pos = l->tail;
+
+  smp_store_release(&l->tail, pos + len);
+  gblfifo_retire(l, pos + len);
+  trace_gblfifo_dequeue(
+      devp->minor, lane, pos, len, gblfifo_lane_len(devp, lane));
+
+  /* lane writers don't wait exclusively, this reaches all of them */
+  if (wq_has_sleeper(&devp->w_wait))
+    wake_up_interruptible_poll(&devp->w_wait, EPOLLOUT | EPOLLWRNORM);
+  if ((gblfifo_len(devp) != 0 || gblfifo_prio_len(devp) != 0) &&
+      wq_has_sleeper(&devp->r_wait))
+    wake_up_interruptible_poll(&devp->r_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* one message off a priority lane, called with mutex held */
+static ssize_t gblfifo_read_lane(
+    struct gblfifo_file *fp, unsigned lane, struct iov_iter *to) {
+  struct gblfifo_dev *devp = fp->devp;
+  struct gblfifo_lane *l = &devp->lanes[lane];
+  u32 rec_len = gblfifo_mem_peek_hdr(l->mem, devp->lane_size, l->tail);
+  size_t len = min_t(size_t, iov_iter_count(to), rec_len), copied;
+
+  copied = gblfifo_mem_copy_to_iter(
+      l->mem, devp->lane_size, l->tail + GBLFIFO_REC_HDR, len, to);
+  if (copied == 0 && len) return -EFAULT;
+
+  if (copied < rec_len && !gblfifo_record(devp)) {
+    /* a stream reader gets the rest next time, behind a header of its own */
+    gblfifo_mem_poke_hdr(
+        l->mem, devp->lane_size, l->tail + copied, rec_len - copied);
+    gblfifo_consume_lane(devp, lane, copied);
+  } else {
+    gblfifo_consume_lane(devp, lane, GBLFIFO_REC_HDR + rec_len);
+  }
+  return copied;
+}
+
+/* drop the record at a shard's tail, called with mutex held */
+static void gblfifo_consume_shard(
+    struct gblfifo_dev *devp, struct gblfifo_shard *sh, u32 rec_len) {
+  unsigned pos = sh->tail, len = gblfifo_shard_hdr(devp) + rec_len;
+
+  if (gblfifo_ordered(devp))
+    WRITE_ONCE(devp->next_seq,
+        max(devp->next_seq, gblfifo_shard_seq(devp, sh, pos) + 1));
+  else
+    WRITE_ONCE(devp->shard_next, (sh->cpu + 1) % nr_cpu_ids);
+  smp_store_release(&sh->tail, pos + len);
+  trace_gblfifo_dequeue(
+      devp->minor, 0, pos, len, gblfifo_shard_len(devp, sh));
+
+  /* shard writers don't wait exclusively, this reaches all of them */
+  if (wq_has_sleeper(&devp->w_wait))
+    wake_up_interruptible_poll(&devp->w_wait, EPOLLOUT | EPOLLWRNORM);
+  if (wq_has_sleeper(&devp->r_wait) && gblfifo_shard_pick(devp))
+    wake_up_interruptible_poll(&devp->r_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* one record off a shard, called with mutex held */
+static ssize_t gblfifo_read_shard(struct gblfifo_dev *devp,
+    struct gblfifo_shard *sh, struct iov_iter *to) {
+  u32 rec_len = gblfifo_mem_peek_hdr(sh->mem, devp->shard_size, sh->tail);
+  size_t len = min_t(size_t, iov_iter_count(to), rec_len), copied;
+
+  copied = gblfifo_mem_copy_to_iter(sh->mem, devp->shard_size,
+      sh->tail + gblfifo_shard_hdr(devp), len, to);
+  if (copied == 0 && len) return -EFAULT;
+  gblfifo_consume_shard(devp, sh, rec_len);
+  return copied;
+}
+
+static ssize_t gblfifo_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+  ssize_t ret = 0;
+  struct file *filp = iocb->ki_filp;
+  struct gblfifo_file *fp = filp->private_data;
+  struct gblfifo_dev *devp = fp->devp;
+  size_t len = iov_iter_count(to);
+  size_t rec_len, copied;
+  unsigned pos, target, lane;
+  struct gblfifo_shard *sh;
+
+  if (len == 0) return 0;
+
+  /* an event loop polling an empty FIFO shouldn't contend with writers */
+  if (gblfifo_nowait(iocb) && !gblfifo_pending(fp) &&
+      !READ_ONCE(fp->lagged))
+    return -EAGAIN;
+
+  ret = gblfifo_lock(devp, iocb);
+  if (ret) return ret;
+
+  target = gblfifo_rcv_target(fp, len);
+  ret = gblfifo_wait_readable(fp, target, gblfifo_nowait(iocb));
+  if (ret == 0) ret = gblfifo_check_lagged(fp);
+  if (ret) goto out;
+
+  lane = gblfifo_pick_lane(fp, gblfifo_bulk_ready(fp, target) ||
+                                   (gblfifo_nowait(iocb) && gblfifo_avail(fp)));
+  if (lane) {
+    ret = gblfifo_read_lane(fp, lane, to);
+    goto out;
+  }
+
+  if (gblfifo_percpu(devp)) {
+    sh = gblfifo_shard_pick(devp);
+    ret = sh ? gblfifo_read_shard(devp, sh, to) : -EAGAIN;
+    goto out;
+  }
+
+  pos = gblfifo_rpos(fp);
+
+  if (gblfifo_record(devp)) {
+    /* one record per read, whatever does not fit is discarded */
+    rec_len = gblfifo_peek_hdr(devp, pos);
+    len = min(len, rec_len);
+    copied = gblfifo_copy_to_iter(devp, pos + GBLFIFO_REC_HDR, len, to);
+    if (copied == 0 && len) {
+      ret = -EFAULT;
+      goto out;
+    }
+    gblfifo_consume(fp, GBLFIFO_REC_HDR + rec_len);
+    ret = copied;
+    goto out;
+  }
+
+  if (len > gblfifo_avail(fp)) len = gblfifo_avail(fp);
+
+  /* a pipe target from splice may take less than asked for */
+  copied = gblfifo_copy_to_iter(devp, pos, len, to);
+  if (copied == 0) {
+    ret = -EFAULT;
+    goto out;
+  } else {
+    gblfifo_consume(fp, copied);
+    ret = copied;
+  }
+
+out:
+  mutex_unlock(&devp->mutex);
+  return ret;
+}
+
+/* signal the empty -> non-empty edge, and otherwise only as configured */
+static void gblfifo_notify(
+    struct gblfifo_dev *devp, unsigned prev, size_t len) {
+  struct gblfifo_sigio *sigio = &devp->sigio;
+
+  if (!devp->async_queue) return;
+
+  devp->sigio_bytes += len;
+  if (prev != 0 &&
+      !(sigio->bytes && devp->sigio_bytes >= sigio->bytes) &&
+      !(sigio->interval_ms &&
+          time_after_eq(jiffies, devp->sigio_last +
+                                     msecs_to_jiffies(sigio->interval_ms))))
+    return;
+
+  pr_debug("gblfifo%d: SIGIO with %u bytes queued\n", devp->minor, prev + len);
+  devp->sigio_bytes = 0;
+  devp->sigio_last = jiffies;
+  kill_fasync(&devp->async_queue, SIGIO, POLL_IN);
+}
+
+static void gblfifo_publish(struct gblfifo_dev *devp, size_t len) {
+  unsigned prev = gblfifo_len(devp);
+
+  trace_gblfifo_enqueue(devp->minor, 0, devp->shm->head, len, prev + len);
+  /* a peer on the mapping may have consumed without telling us */
+  gblfifo_retire(&devp->lanes[0], devp->shm->tail);
+  smp_store_release(&devp->shm->head, devp->shm->head + len);
+  devp->high_water = max_t(unsigned, devp->high_water, prev + len);
+  if (gblfifo_broadcast(devp)) {
+    /* every sleeping reader has caught up, so each one has data now */
+    wake_up_interruptible_all(&devp->r_wait);
+    /* nobody to deliver to, drop it right away */
+    if (list_empty(&devp->readers)) gblfifo_update_tail(devp);
+  } else if (gblfifo_crossed(prev, prev + len, devp->rcvlowat_min,
+                 devp->rcvlowat_max) ||
+             prev + len >= devp->rcv_sleep_min ||
+             (prev == 0 && devp->nr_timed)) {
+    /*
+     * only reaching a poller's watermark or a blocked read's target can
+     * unblock a reader, or the first byte for one that has to start its
+     * max-wait clock
+     */
+    wake_up_interruptible_poll(&devp->r_wait, EPOLLIN | EPOLLRDNORM);
+  }
+
+  /* pass the wakeup on if there is room left for another writer */
+  if (gblfifo_room(devp) != 0 && wq_has_sleeper(&devp->w_wait))
+    wake_up_interruptible_poll(&devp->w_wait, EPOLLOUT | EPOLLWRNORM);
+
+  gblfifo_notify(devp, prev, len);
+}
+
+/*
+ * Hand what buf holds over to spill_work, which appends it to the file,
+ * and start on an empty buf. A handover still being written is waited for,
+ * or fails a nonblocking writer with EAGAIN. Called and returns with mutex
+ * held, nr_waiting keeps the file from being detached meanwhile.
+ */
+static int gblfifo_spill_handover(struct gblfifo_dev *devp, bool nonblock) {
+  struct gblfifo_spill_file *sp = devp->spill;
+  uint8_t *buf;
+  int ret = 0;
+
+  while (sp->wbuf_len && !sp->err) {
+    if (nonblock) return -EAGAIN;
+    sp->nr_waiting++;
+    mutex_unlock(&devp->mutex);
+    ret = wait_event_interruptible(devp->w_wait,
+        !READ_ONCE(sp->wbuf_len) || READ_ONCE(sp->err));
+    mutex_lock(&devp->mutex);
+    sp->nr_waiting--;
+    if (ret) return ret;
+  }
+  if (sp->err) return sp->err;
+
+  buf = sp->wbuf;
+  sp->wbuf = sp->buf;
+  sp->wbuf_rd = sp->buf_rd;
+  sp->wbuf_len = sp->buf_len;
+  sp->buf = buf;
+  sp->buf_rd = sp->buf_len = 0;
+  schedule_work(&devp->spill_work);
+  return 0;
+}
+
+/* len more bytes overflowed, called with mutex held */
+static void gblfifo_spilled(struct gblfifo_dev *devp, size_t len) {
+  struct gblfifo_spill_file *sp = devp->spill;
+
+  sp->len += len;
+  sp->spilled += len;
+  sp->high_water = max(sp->high_water, sp->len);
+  /* past that the free running positions can't be told apart */
+  if (sp->len <= INT_MAX)
+    gblfifo_mark(&devp->lanes[0], devp->shm->head + sp->len);
+  /* readers may have made room before there was anything to refill */
+  if (gblfifo_room(devp) != 0) schedule_work(&devp->spill_work);
+}
+
+/* queue a write behind the spilled data, called with mutex held */
+static ssize_t gblfifo_spill_write(
+    struct gblfifo_dev *devp, struct iov_iter *from, bool nonblock) {
+  struct gblfifo_spill_file *sp = devp->spill;
+  size_t len = iov_iter_count(from), need = GBLFIFO_REC_HDR + len;
+  size_t copied = 0, n;
+  u32 hdr = len;
+  int ret = 0;
+
+  if (sp->err) return sp->err;
+
+  if (gblfifo_record(devp)) {
+    if (need > devp->size) return -EMSGSIZE;
+    if (sp->max_bytes && sp->len + need > sp->max_bytes) return -ENOSPC;
+    /* a record never straddles a handover, a failed one leaves no half */
+    if (sp->chunk - sp->buf_len < need) {
+      ret = gblfifo_spill_handover(devp, nonblock);
+      if (ret) return ret;
+    }
+    if (copy_from_iter(sp->buf + sp->buf_len + GBLFIFO_REC_HDR, len, from) !=
+        len)
+      return -EFAULT;
+    memcpy(sp->buf + sp->buf_len, &hdr, GBLFIFO_REC_HDR);
+    sp->buf_len += need;
+    gblfifo_spilled(devp, need);
+    return len;
+  }
+
+  if (sp->max_bytes) len = min_t(u64, len, sp->max_bytes - sp->len);
+  if (len == 0) return -ENOSPC;
+
+  while (copied < len) {
+    if (sp->buf_len == sp->chunk) {
+      ret = gblfifo_spill_handover(devp, nonblock);
+      if (ret) break;
+    }
+    n = copy_from_iter(sp->buf + sp->buf_len,
+        min(len - copied, sp->chunk - sp->buf_len), from);
+    if (n == 0) {
+      ret = -EFAULT;
+      break;
+    }
+    sp->buf_len += n;
+    copied += n;
+  }
+  if (copied == 0) return ret;
+  gblfifo_spilled(devp, copied);
+  return copied;
+}
+
+/*
+ * Append the handed over buffer to the file, dropping the mutex around the
+ * write. Called with mutex held, returns whether to carry on.
+ */
+static bool gblfifo_spill_flush(
+    struct gblfifo_dev *devp, struct gblfifo_spill_file *sp) {
+  size_t len = sp->wbuf_len - sp->wbuf_rd;
+  unsigned gen = sp->gen;
+  loff_t pos = sp->wr;
+  ssize_t ret;
+
+  sp->busy = true;
+  mutex_unlock(&devp->mutex);
+  ret = kernel_write(sp->filp, sp->wbuf + sp->wbuf_rd, len, &pos);
+  mutex_lock(&devp->mutex);
+  sp->busy = false;
+  /* cleared meanwhile, what we wrote is stale */
+  if (sp->gen != gen) return true;
+
+  if (ret != len) {
+    sp->err = ret < 0 ? ret : -EIO;
+  } else {
+    sp->wr = pos;
+    sp->wbuf_rd = sp->wbuf_len = 0;
+  }
+  /* writers waiting for the handover to finish, or for the error */
+  wake_up_interruptible_all(&devp->w_wait);
+  return !sp->err;
+}
+
+/* len bytes of the file from pos into the ring at at */
+static int gblfifo_spill_read(struct gblfifo_dev *devp,
+    struct gblfifo_spill_file *sp, unsigned at, size_t len, loff_t pos) {
+  size_t off, n;
+  ssize_t ret;
+
+  while (len) {
+    off = at & (devp->size - 1);
+    n = min_t(size_t, len, devp->size - off);
+    ret = kernel_read(sp->filp, devp->mem + off, n, &pos);
+    if (ret != n) return ret < 0 ? ret : -EIO;
+    at += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* the first len spilled bytes are in the ring now */
+static void gblfifo_spill_advance(struct gblfifo_spill_file *sp, size_t len) {
+  size_t n = min_t(u64, len, sp->wr - sp->rd);
+
+  sp->rd += n;
+  sp->buf_rd += len - n;
+  sp->len -= len;
+  /* start over at the front of the file, and of buf, once drained */
+  if (sp->rd == sp->wr) sp->rd = sp->wr = 0;
+  if (sp->buf_rd == sp->buf_len) sp->buf_rd = sp->buf_len = 0;
+}
+
+/*
+ * Fill the ring's room from the spilled data, file part first, then buf
+ * once nothing is handed over. The file is read without the mutex, busy
+ * keeps writers off the ring meanwhile. Bytes past the last whole record
+ * are copied too but not published, the next refill copies them again.
+ * Called with mutex held, returns whether to carry on.
+ */
+static bool gblfifo_refill(
+    struct gblfifo_dev *devp, struct gblfifo_spill_file *sp) {
+  unsigned head = devp->shm->head, gen = sp->gen;
+  size_t room = gblfifo_room(devp), n, len = 0;
+  struct kvec kv;
+  struct iov_iter iter;
+  u32 rec_len;
+  int ret;
+
+  n = min_t(u64, room, sp->wr - sp->rd);
+  if (n) {
+    sp->busy = true;
+    mutex_unlock(&devp->mutex);
+    ret = gblfifo_spill_read(devp, sp, head, n, sp->rd);
+    mutex_lock(&devp->mutex);
+    sp->busy = false;
+    /* cleared meanwhile, look again */
+    if (sp->gen != gen) return true;
+    if (ret) {
+      sp->err = ret;
+      wake_up_interruptible_all(&devp->w_wait);
+      return false;
+    }
+  }
+  /* buf only comes after the whole file part and the handed over one */
+  if (n == (u64)(sp->wr - sp->rd) && !sp->wbuf_len && n < room &&
+      sp->buf_rd < sp->buf_len) {
+    kv.iov_base = sp->buf + sp->buf_rd;
+    kv.iov_len = min(room - n, sp->buf_len - sp->buf_rd);
+    iov_iter_kvec(&iter, WRITE, &kv, 1, kv.iov_len);
+    n += gblfifo_copy_from_iter(devp, head + n, kv.iov_len, &iter);
+  }
+
+  if (gblfifo_record(devp)) {
+    while (len + GBLFIFO_REC_HDR <= n) {
+      rec_len = gblfifo_peek_hdr(devp, head + len);
+      if (len + GBLFIFO_REC_HDR + rec_len > n) break;
+      len += GBLFIFO_REC_HDR + rec_len;
+    }
+  } else {
+    len = n;
+  }
+  if (len == 0) return false;
+
+  gblfifo_spill_advance(sp, len);
+  gblfifo_publish(devp, len);
+  return true;
+}
+
+/* drop everything spilled, called with mutex held */
+static void gblfifo_clear_spill(struct gblfifo_spill_file *sp) {
+  sp->rd = sp->wr = 0;
+  sp->buf_rd = sp->buf_len = 0;
+  sp->wbuf_rd = sp->wbuf_len = 0;
+  sp->len = sp->high_water = sp->spilled = 0;
+  sp->err = 0;
+  /* spill_work drops what it's reading or writing */
+  sp->gen++;
+}
+
+/*
+ * All file I/O happens here, one handover or refill at a time with the
+ * mutex dropped around it, so writers and readers never wait on the disk.
+ */
+static void gblfifo_spill_work(struct work_struct *work) {
+  struct gblfifo_dev *devp =
+      container_of(work, struct gblfifo_dev, spill_work);
+  struct gblfifo_spill_file *sp;
+
+  mutex_lock(&devp->mutex);
+  while ((sp = devp->spill) && !sp->err) {
+    if (sp->wbuf_len) {
+      if (!gblfifo_spill_flush(devp, sp)) break;
+    } else if (!sp->len || !gblfifo_room(devp) || !gblfifo_refill(devp, sp)) {
+      break;
+    }
+  }
+  mutex_unlock(&devp->mutex);
+}
+
+static bool gblfifo_lane_writable(
+    struct gblfifo_dev *devp, unsigned lane, size_t need) {
+  return gblfifo_lane_room(devp, lane) >= need || gblfifo_broadcast(devp);
+}
+
+/* queue one message on a priority lane, called and returns with mutex held */
+static ssize_t gblfifo_write_lane(struct gblfifo_file *fp, unsigned lane,
+    struct iov_iter *from, bool nonblock) {
+  struct gblfifo_dev *devp = fp->devp;
+  struct gblfifo_lane *l = &devp->lanes[lane];
+  size_t len = iov_iter_count(from), need = GBLFIFO_REC_HDR + len;
+  unsigned prev;
+  int ret;
+
+  if (need > devp->lane_size) return -EMSGSIZE;
+
+  while (!gblfifo_lane_writable(devp, lane, need)) {
+    if (nonblock) return -EAGAIN;
+
+    trace_gblfifo_block(
+        devp->minor, true, need, gblfifo_lane_room(devp, lane));
+    mutex_unlock(&devp->mutex);
+    /* not exclusive, lane 0 writers on the queue can't use our wakeups */
+    ret = wait_event_interruptible(
+        devp->w_wait, gblfifo_lane_writable(devp, lane, need));
+    mutex_lock(&devp->mutex);
+    trace_gblfifo_wake(devp->minor, true, ret);
+
+    if (ret) return ret;
+  }
+  /* every reader has its own cursor into lane 0 only */
+  if (gblfifo_broadcast(devp)) return -EINVAL;
+
+  if (gblfifo_mem_copy_from_iter(l->mem, devp->lane_size,
+          l->head + GBLFIFO_REC_HDR, len, from) != len)
+    return -EFAULT;
+  gblfifo_mem_poke_hdr(l->mem, devp->lane_size, l->head, len);
+
+  prev = gblfifo_lane_len(devp, lane);
+  trace_gblfifo_enqueue(devp->minor, lane, l->head, need, prev + need);
+  gblfifo_mark(l, l->head + need);
+  smp_store_release(&l->head, l->head + need);
+  l->high_water = max_t(unsigned, l->high_water, prev + need);
+
+  /* no watermark holds a priority message back, so anyone can take it */
+  wake_up_interruptible_poll(&devp->r_wait, EPOLLIN | EPOLLRDNORM);
+  gblfifo_notify(devp, 0, need);
+  return len;
+}
+
+/* write to lane 0, called and returns with mutex held */
+static ssize_t gblfifo_write_bulk(
+    struct gblfifo_file *fp, struct iov_iter *from, bool nonblock) {
+  struct gblfifo_dev *devp = fp->devp;
+  size_t len = iov_iter_count(from);
+  size_t need = 1, copied;
+  unsigned head;
+  int ret;
+
+  /* a record is queued whole or not at all, too big ones fail in the wait */
+  if (gblfifo_record(devp)) {
+    need = GBLFIFO_REC_HDR + len;
+  } else if (gblfifo_overwrite(devp)) {
+    /* make room for as much of the write as the ring holds */
+    need = min_t(size_t, len, devp->size);
+  } else if (len <= min_t(size_t, PIPE_BUF, devp->size)) {
+    /*
+     * like a pipe, a small write (all segments of a writev) goes into a
+     * single reservation, so it never interleaves with another writer
+     */
+    need = len;
+  } else if (!nonblock) {
+    need = min_t(size_t, fp->sndlowat, len);
+  }
+
+  ret = gblfifo_wait_writable(fp, need, nonblock);
+  if (ret) return ret;
+
+  /* nothing may overtake what already overflowed */
+  if (devp->spill && (devp->spill->len || devp->spill->busy ||
+                         gblfifo_room(devp) < need))
+    return gblfifo_spill_write(devp, from, nonblock);
+
+  head = READ_ONCE(devp->shm->head);
+
+  if (gblfifo_record(devp)) {
+    copied = gblfifo_copy_from_iter(devp, head + GBLFIFO_REC_HDR, len, from);
+    if (copied != len) return -EFAULT;
+    gblfifo_poke_hdr(devp, head, len);
+    gblfifo_mark(&devp->lanes[0], head + GBLFIFO_REC_HDR + len);
+    gblfifo_publish(devp, GBLFIFO_REC_HDR + len);
+    return len;
+  }
+
+  if (len >= gblfifo_room(devp)) len = gblfifo_room(devp);
+
+  copied = gblfifo_copy_from_iter(devp, head, len, from);
+  if (copied == 0) return -EFAULT;
+  gblfifo_mark(&devp->lanes[0], head + copied);
+  gblfifo_publish(devp, copied);
+  return copied;
+}
+
+/*
+ * Append a record to the shard of the CPU we're on, without the mutex.
+ * Writers elsewhere only share shard_sem's per-CPU counts with us, and the
+ * sequence counter in ordered mode. trylock is for IOCB_NOWAIT. Returns 0
+ * if the device is not in percpu mode, the write then takes the usual way.
+ */
+static ssize_t gblfifo_write_shard(struct gblfifo_file *fp,
+    struct iov_iter *from, bool nonblock, bool trylock) {
+  struct gblfifo_dev *devp = fp->devp;
+  size_t len = iov_iter_count(from), need;
+  struct gblfifo_shard *sh;
+  unsigned head;
+  u64 seq;
+  ssize_t ret;
+
+  for (;;) {
+    if (!trylock)
+      percpu_down_read(&devp->shard_sem);
+    else if (!percpu_down_read_trylock(&devp->shard_sem))
+      return -EAGAIN;
+
+    ret = 0;
+    if (!gblfifo_percpu(devp)) goto out_sem;
+    need = gblfifo_shard_hdr(devp) + len;
+    ret = -EMSGSIZE;
+    if (need > devp->shard_size) goto out_sem;
+
+    /* if we migrate after this, the write only loses its locality */
+    sh = devp->shards[raw_smp_processor_id()];
+    ret = -EAGAIN;
+    if (!trylock)
+      mutex_lock(&sh->lock);
+    else if (!mutex_trylock(&sh->lock))
+      goto out_sem;
+    if (gblfifo_shard_room(devp, sh) >= need) break;
+    mutex_unlock(&sh->lock);
+    percpu_up_read(&devp->shard_sem);
+
+    if (nonblock) return -EAGAIN;
+    trace_gblfifo_block(
+        devp->minor, true, need, gblfifo_shard_room(devp, sh));
+    ret = wait_event_interruptible(devp->w_wait,
+        gblfifo_shard_room(devp, sh) >= need || !gblfifo_percpu(devp));
+    trace_gblfifo_wake(devp->minor, true, ret);
+    if (ret) return ret;
+  }
+
+  head = sh->head;
+  ret = -EFAULT;
+  if (gblfifo_mem_copy_from_iter(sh->mem, devp->shard_size,
+          head + need - len, len, from) != len)
+    goto out;
+  gblfifo_mem_poke_hdr(sh->mem, devp->shard_size, head, len);
+
+  /* ordered readers wait for every number, so hand it out late and publish */
+  preempt_disable();
+  if (gblfifo_ordered(devp)) {
+    seq = atomic64_fetch_inc(&devp->seq);
+    gblfifo_mem_poke_hdr(sh->mem, devp->shard_size, head + GBLFIFO_REC_HDR,
+        lower_32_bits(seq));
+    gblfifo_mem_poke_hdr(sh->mem, devp->shard_size,
+        head + GBLFIFO_REC_HDR + 4, upper_32_bits(seq));
+  }
+  smp_store_release(&sh->head, head + need);
+  preempt_enable();
+  sh->msgs++;
+  trace_gblfifo_enqueue(
+      devp->minor, 0, head, need, gblfifo_shard_len(devp, sh));
+  ret = len;
+
+  if (wq_has_sleeper(&devp->r_wait))
+    wake_up_interruptible_poll(&devp->r_wait, EPOLLIN | EPOLLRDNORM);
+out:
+  mutex_unlock(&sh->lock);
+out_sem:
+  percpu_up_read(&devp->shard_sem);
+  return ret;
+}
+
+/*
+ * Lane 0 goes to the shards in percpu mode, anything else needs the mutex.
+ * Returns what went into a shard, or 0 with the mutex held. The mode only
+ * holds still under the mutex, a switch in between sends us round again.
+ */
+static ssize_t gblfifo_write_begin(struct gblfifo_file *fp, unsigned lane,
+    struct iov_iter *from, bool nonblock, bool trylock) {
+  struct gblfifo_dev *devp = fp->devp;
+  ssize_t ret;
+
+  for (;;) {
+    if (!lane && READ_ONCE(devp->shards)) {
+      ret = gblfifo_write_shard(fp, from, nonblock, trylock);
+      if (ret) return ret;
+    }
+    if (!trylock)
+      mutex_lock(&devp->mutex);
+    else if (!mutex_trylock(&devp->mutex))
+      return -EAGAIN;
+    if (lane || !gblfifo_percpu(devp)) return 0;
+    mutex_unlock(&devp->mutex);
+  }
+}
+
+static ssize_t gblfifo_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+  ssize_t ret = 0;
+  struct file *filp = iocb->ki_filp;
+  struct gblfifo_file *fp = filp->private_data;
+  struct gblfifo_dev *devp = fp->devp;
+  unsigned lane = READ_ONCE(fp->lane);
+
+  if (iov_iter_count(from) == 0) return 0;
+
+  ret = gblfifo_write_begin(
+      fp, lane, from, gblfifo_nowait(iocb), iocb->ki_flags & IOCB_NOWAIT);
+  if (ret) return ret;
+
+  if (lane)
+    ret = gblfifo_write_lane(fp, lane, from, gblfifo_nowait(iocb));
+  else
+    ret = gblfifo_write_bulk(fp, from, gblfifo_nowait(iocb));
+
+  mutex_unlock(&devp->mutex);
+  return ret;
+}
+
+/* a single write to any lane, like write() on a blocking or O_NONBLOCK fd */
+static long gblfifo_send(
+    struct file *filp, struct gblfifo_send __user *usend) {
+  struct gblfifo_file *fp = filp->private_data;
+  struct gblfifo_dev *devp = fp->devp;
+  bool nonblock = filp->f_flags & O_NONBLOCK;
+  struct gblfifo_send send;
+  struct iovec iov;
+  struct iov_iter iter;
+  long ret;
+
+  if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+  if (copy_from_user(&send, usend, sizeof(send))) return -EFAULT;
+  if (send.lane >= GBLFIFO_NR_LANES) return -EINVAL;
+
+  ret = import_single_range(
+      WRITE, u64_to_user_ptr(send.buf), send.len, &iov, &iter);
+  if (ret) return ret;
+  if (send.len == 0) return 0;
+
+  ret = gblfifo_write_begin(fp, send.lane, &iter, nonblock, false);
+  if (ret) return ret;
+  if (send.lane)
+    ret = gblfifo_write_lane(fp, send.lane, &iter, nonblock);
+  else
+    ret = gblfifo_write_bulk(fp, &iter, nonblock);
+  mutex_unlock(&devp->mutex);
+  return ret;
+}
+
+/* RECV_BATCH in percpu mode, called with mutex held */
+static long gblfifo_recv_shards(struct gblfifo_dev *devp,
+    struct gblfifo_batch *batch, struct iov_iter *iter, u32 __user *lens,
+    u64 __user *stamps) {
+  struct gblfifo_shard *sh;
+  u32 rec_len;
+  size_t n;
 
-static int gblfifo_open(struct inode *inode, struct file *filp) {
-  filp->private_data = container_of(inode->i_cdev, struct gblfifo_dev, cdev);
+  while (batch->nr_msgs < batch->max_msgs &&
+         (sh = gblfifo_shard_pick(devp))) {
+    rec_len = gblfifo_mem_peek_hdr(sh->mem, devp->shard_size, sh->tail);
+    if (rec_len > iov_iter_count(iter) && batch->nr_msgs) break;
+
+    n = min_t(size_t, rec_len, iov_iter_count(iter));
+    /* shard writes aren't stamped */
+    if (gblfifo_mem_copy_to_iter(sh->mem, devp->shard_size,
+            sh->tail + gblfifo_shard_hdr(devp), n, iter) != n ||
+        put_user(n, lens + batch->nr_msgs) ||
+        (stamps && put_user(0, stamps + batch->nr_msgs)))
+      return batch->nr_msgs ? 0 : -EFAULT;
+
+    gblfifo_consume_shard(devp, sh, rec_len);
+    batch->nr_msgs++;
+    batch->bytes += n;
+  }
   return 0;
 }
 
-static ssize_t gblfifo_read(
-    struct file *filp, char __user *buf, size_t len, loff_t *ppos) {
-  int ret = 0;
-  struct gblfifo_dev *devp = filp->private_data;
-  DECLARE_WAITQUEUE(wait, current);
-
-  mutex_lock(&devp->mutex);
+/* hand out as many whole records as fit, in one call, stamps may be NULL */
+static long gblfifo_recv_batch(struct file *filp,
+    struct gblfifo_batch __user *ubatch, u64 __user *stamps) {
+  struct gblfifo_file *fp = filp->private_data;
+  struct gblfifo_dev *devp = fp->devp;
+  struct gblfifo_batch batch;
+  u32 __user *lens;
+  struct iovec iov;
+  struct iov_iter iter;
+  unsigned pos, start, avail, lane, size, k;
+  uint8_t *mem;
+  bool nonblock = filp->f_flags & O_NONBLOCK;
+  size_t rec_len, n;
+  long ret;
 
-  add_wait_queue(&devp->r_wait, &wait);
+  if (copy_from_user(&batch, ubatch, sizeof(batch))) return -EFAULT;
+  if (batch.max_msgs == 0 || !batch.lens) return -EINVAL;
 
-  while (devp->curl == 0) {
-    if (filp->f_flags & O_NONBLOCK) {
-      ret = -EAGAIN;
-      goto out;
-    }
+  ret = import_single_range(
+      READ, u64_to_user_ptr(batch.buf), batch.buf_len, &iov, &iter);
+  if (ret) return ret;
+  lens = u64_to_user_ptr(batch.lens);
+  batch.nr_msgs = batch.bytes = 0;
 
-    mutex_unlock(&devp->mutex);
-    set_current_state(TASK_INTERRUPTIBLE);
-    schedule();
+  mutex_lock(&devp->mutex);
 
-    if (signal_pending(current)) {
-      remove_wait_queue(&devp->r_wait, &wait);
-      set_current_state(TASK_RUNNING);
-      return -ERESTARTSYS;
-    }
-    mutex_lock(&devp->mutex);
+  if (!gblfifo_record(devp)) {
+    ret = -EINVAL;
+    goto out;
   }
 
-  if (len > devp->curl) len = devp->curl;
+  ret = gblfifo_wait_readable(fp, fp->rcvlowat, nonblock);
+  if (ret == 0) ret = gblfifo_check_lagged(fp);
+  if (ret) goto out;
 
-  if (copy_to_user(buf, devp->mem, len)) {
-    ret = -EFAULT;
+  /* priority messages have the same layout as records */
+  lane = gblfifo_pick_lane(fp, gblfifo_bulk_ready(fp, fp->rcvlowat) ||
+                                   (nonblock && gblfifo_avail(fp)));
+  if (!lane && gblfifo_percpu(devp)) {
+    ret = gblfifo_recv_shards(devp, &batch, &iter, lens, stamps);
     goto out;
+  }
+  if (lane) {
+    mem = devp->lanes[lane].mem;
+    size = devp->lane_size;
+    start = pos = devp->lanes[lane].tail;
+    avail = gblfifo_lane_len(devp, lane);
   } else {
-    memcpy(devp->mem, devp->mem + len, devp->curl - len);
-    devp->curl -= len;
-    wake_up_interruptible(&devp->w_wait);
-    ret = len;
+    mem = devp->mem;
+    size = devp->size;
+    start = pos = gblfifo_rpos(fp);
+    avail = gblfifo_avail(fp);
+  }
+  k = devp->lanes[lane].mark_tail;
+  while (avail && batch.nr_msgs < batch.max_msgs) {
+    rec_len = gblfifo_mem_peek_hdr(mem, size, pos);
+    /* only the first record may be truncated, like read() would */
+    if (rec_len > iov_iter_count(&iter) && batch.nr_msgs) break;
+
+    n = min(rec_len, iov_iter_count(&iter));
+    if (gblfifo_mem_copy_to_iter(
+            mem, size, pos + GBLFIFO_REC_HDR, n, &iter) != n ||
+        put_user(n, lens + batch.nr_msgs) ||
+        (stamps && put_user(gblfifo_stamp(&devp->lanes[lane], &k,
+                                pos + GBLFIFO_REC_HDR + rec_len),
+                       stamps + batch.nr_msgs))) {
+      ret = -EFAULT;
+      break;
+    }
+
+    pos += GBLFIFO_REC_HDR + rec_len;
+    avail -= GBLFIFO_REC_HDR + rec_len;
+    batch.nr_msgs++;
+    batch.bytes += n;
+  }
+
+  if (batch.nr_msgs) {
+    if (lane)
+      gblfifo_consume_lane(devp, lane, pos - start);
+    else
+      gblfifo_consume(fp, pos - start);
+    ret = 0;
   }
 
 out:
-  remove_wait_queue(&devp->r_wait, &wait);
   mutex_unlock(&devp->mutex);
-  set_current_state(TASK_RUNNING);
+
+  if (ret == 0 && copy_to_user(ubatch, &batch, sizeof(batch))) ret = -EFAULT;
   return ret;
 }
 
-static ssize_t gblfifo_write(
-    struct file *filp, const char __user *buf, size_t len, loff_t *ppos) {
+static long gblfifo_recv_batch_ts(
+    struct file *filp, struct gblfifo_batch_ts __user *ubts) {
+  u64 stamps;
+
+  if (get_user(stamps, &ubts->stamps)) return -EFAULT;
+  if (!stamps) return -EINVAL;
+  return gblfifo_recv_batch(filp, &ubts->batch, u64_to_user_ptr(stamps));
+}
+
+static loff_t gblfifo_llseek(struct file *filp, loff_t offset, int orig) {
+  return -EINVAL;
+}
+
+/* no shard holds anything, stable with shard_sem held for writing */
+static bool gblfifo_shards_empty(struct gblfifo_dev *devp) {
+  int cpu;
+
+  if (!devp->shards) return true;
+  for_each_possible_cpu(cpu) {
+    if (gblfifo_shard_len(devp, devp->shards[cpu])) return false;
+  }
+  return true;
+}
+
+/*
+ * Drop what the shards hold, called with mutex held. A writer that took a
+ * number before and publishes after still gets its record through.
+ */
+static void gblfifo_clear_shards(struct gblfifo_dev *devp) {
+  struct gblfifo_shard *sh;
+  int cpu;
+
+  if (!devp->shards) return;
+  for_each_possible_cpu(cpu) {
+    sh = devp->shards[cpu];
+    mutex_lock(&sh->lock);
+    smp_store_release(&sh->tail, sh->head);
+    sh->msgs = 0;
+    mutex_unlock(&sh->lock);
+  }
+  WRITE_ONCE(devp->next_seq, atomic64_read(&devp->seq));
+}
+
+static void gblfifo_free_shards(struct gblfifo_dev *devp) {
+  int cpu;
+
+  if (!devp->shards) return;
+  for_each_possible_cpu(cpu) vfree(devp->shards[cpu]);
+  kfree(devp->shards);
+  devp->shards = NULL;
+}
+
+/*
+ * Every possible CPU gets a shard on its own node, they stay until the
+ * device goes away. Called with mutex held.
+ */
+static int gblfifo_alloc_shards(struct gblfifo_dev *devp) {
+  unsigned long size = clamp_t(unsigned long, shard_size,
+      GBLFIFO_REC_HDR + sizeof(u64) + 1, GBLFIFO_MAX_SIZE);
+  struct gblfifo_shard **shards;
+  struct gblfifo_shard *sh;
+  int cpu;
+
+  if (devp->shards) return 0;
+  size = roundup_pow_of_two(size);
+  shards = kcalloc(nr_cpu_ids, sizeof(*shards), GFP_KERNEL);
+  if (!shards) return -ENOMEM;
+
+  for_each_possible_cpu(cpu) {
+    sh = vzalloc_node(sizeof(*sh) + size, cpu_to_node(cpu));
+    if (!sh) goto error;
+    mutex_init(&sh->lock);
+    sh->cpu = cpu;
+    shards[cpu] = sh;
+  }
+  devp->shard_size = size;
+  /* lockless readers find the size set once they see the array */
+  smp_store_release(&devp->shards, shards);
+  return 0;
+
+error:
+  for_each_possible_cpu(cpu) vfree(shards[cpu]);
+  kfree(shards);
+  return -ENOMEM;
+}
+
+static int gblfifo_set_mode(struct gblfifo_dev *devp, unsigned mode) {
+  struct gblfifo_file *fp;
+  bool locked = false;
   int ret = 0;
-  struct gblfifo_dev *devp = filp->private_data;
 
-  DECLARE_WAITQUEUE(wait, current);
+  if (mode & ~(GBLFIFO_MODE_BROADCAST | GBLFIFO_MODE_DROP_LAGGING |
+                  GBLFIFO_MODE_RECORD | GBLFIFO_MODE_OVERWRITE |
+                  GBLFIFO_MODE_PERCPU | GBLFIFO_MODE_ORDERED))
+    return -EINVAL;
+  if ((mode & GBLFIFO_MODE_BROADCAST) && (mode & GBLFIFO_MODE_OVERWRITE))
+    return -EINVAL;
+  /* shards hold records for whoever reads first, and never drop any */
+  if ((mode & GBLFIFO_MODE_ORDERED) && !(mode & GBLFIFO_MODE_PERCPU))
+    return -EINVAL;
+  if ((mode & GBLFIFO_MODE_PERCPU) &&
+      (!(mode & GBLFIFO_MODE_RECORD) ||
+          (mode & (GBLFIFO_MODE_BROADCAST | GBLFIFO_MODE_OVERWRITE))))
+    return -EINVAL;
 
   mutex_lock(&devp->mutex);
-  add_wait_queue(&devp->w_wait, &wait);
-
-  while (devp->curl >= GBLFIFO_SIZE) {
-    if (filp->f_flags & O_NONBLOCK) {
-      ret = -EAGAIN;
-      goto out;
+  /*
+   * a mapped peer can only follow the single shared tail, only knows about
+   * byte streams, and owns tail so the kernel can't move it to overwrite.
+   * gblfifo_mmap checks the mode with the mutex held, so check under it too
+   */
+  if ((mode & (GBLFIFO_MODE_BROADCAST | GBLFIFO_MODE_RECORD |
+                  GBLFIFO_MODE_OVERWRITE)) &&
+      atomic_read(&devp->nr_maps)) {
+    mutex_unlock(&devp->mutex);
+    return -EBUSY;
+  }
+  /* queued bytes can't be reinterpreted as records or the other way round */
+  if (((mode ^ devp->mode) & GBLFIFO_MODE_RECORD) &&
+      (devp->shm->head != devp->shm->tail || gblfifo_spilling(devp))) {
+    mutex_unlock(&devp->mutex);
+    return -EBUSY;
+  }
+  /* spilled data follows the single tail, and is never dropped */
+  if ((mode & (GBLFIFO_MODE_BROADCAST | GBLFIFO_MODE_OVERWRITE |
+                  GBLFIFO_MODE_PERCPU)) &&
+      devp->spill) {
+    mutex_unlock(&devp->mutex);
+    return -EBUSY;
+  }
+  /* readers only get cursors into lane 0 */
+  if ((mode & GBLFIFO_MODE_BROADCAST) && gblfifo_prio_len(devp) != 0) {
+    mutex_unlock(&devp->mutex);
+    return -EBUSY;
+  }
+  /* readers look at either the ring or the shards, never both */
+  if ((mode ^ devp->mode) & (GBLFIFO_MODE_PERCPU | GBLFIFO_MODE_ORDERED)) {
+    if (devp->shm->head != devp->shm->tail) {
+      mutex_unlock(&devp->mutex);
+      return -EBUSY;
+    }
+    if (mode & GBLFIFO_MODE_PERCPU) ret = gblfifo_alloc_shards(devp);
+    if (ret) {
+      mutex_unlock(&devp->mutex);
+      return ret;
+    }
+    /* shard writers check the mode with shard_sem held */
+    percpu_down_write(&devp->shard_sem);
+    if (!gblfifo_shards_empty(devp)) {
+      percpu_up_write(&devp->shard_sem);
+      mutex_unlock(&devp->mutex);
+      return -EBUSY;
+    }
+    devp->next_seq = atomic64_read(&devp->seq);
+    locked = true;
+  }
+  if ((mode ^ devp->mode) & GBLFIFO_MODE_BROADCAST) {
+    /* hand whatever is queued to every reader */
+    list_for_each_entry(fp, &devp->readers, node) {
+      WRITE_ONCE(fp->cursor, devp->shm->tail);
+      WRITE_ONCE(fp->lagged, false);
     }
+  }
+  pr_debug("gblfifo%d: mode %#x -> %#x\n", devp->minor, devp->mode, mode);
+  devp->mode = mode;
+  if (locked) percpu_up_write(&devp->shard_sem);
+  mutex_unlock(&devp->mutex);
+
+  wake_up_interruptible_all(&devp->r_wait);
+  /* priority lane writers fail once broadcast is on, shard writers move */
+  wake_up_interruptible_all(&devp->w_wait);
+  return 0;
+}
+
+static uint8_t *gblfifo_alloc_ring(unsigned long *size) {
+  if (*size < GBLFIFO_MIN_SIZE || *size > GBLFIFO_MAX_SIZE)
+    return ERR_PTR(-EINVAL);
+  *size = roundup_pow_of_two(*size);
+  /* zeroed and page backed, so it can be handed to remap_vmalloc_range */
+  return vmalloc_user(PAGE_ALIGN(*size)) ?: ERR_PTR(-ENOMEM);
+}
 
+/*
+ * Move the queued bytes to a ring of the new size. head, tail and the
+ * cursors keep their values, the bytes just land at their new offsets, so
+ * sleepers re-evaluating their conditions see nothing but a new size.
+ */
+static int gblfifo_resize(struct gblfifo_dev *devp, unsigned long arg) {
+  unsigned size, old_size, pos, head, n, nr_marks;
+  struct gblfifo_mark *marks;
+  uint8_t *mem, *old;
+
+  mem = gblfifo_alloc_ring(&arg);
+  if (IS_ERR(mem)) return PTR_ERR(mem);
+  size = arg;
+  marks = gblfifo_alloc_marks(size, &nr_marks);
+  if (!marks) {
+    vfree(mem);
+    return -ENOMEM;
+  }
+
+  mutex_lock(&devp->mutex);
+  /*
+   * a peer on the mapping would keep using the old ring, and the spill
+   * buffer is sized to hold a ring's worth of record
+   */
+  if (atomic_read(&devp->nr_maps) || devp->spill || gblfifo_len(devp) > size ||
+      devp->rcvlowat_max > size || devp->sndlowat_max > size) {
     mutex_unlock(&devp->mutex);
-    set_current_state(TASK_INTERRUPTIBLE);
-    schedule();
+    kvfree(marks);
+    vfree(mem);
+    return -EBUSY;
+  }
 
-    if (signal_pending(current)) {
-      remove_wait_queue(&devp->w_wait, &wait);
-      set_current_state(TASK_RUNNING);
-      return -ERESTARTSYS;
-    }
-    mutex_lock(&devp->mutex);
+  old = devp->mem;
+  old_size = devp->size;
+  head = devp->shm->head;
+  for (pos = devp->shm->tail; pos != head; pos += n) {
+    n = min3(head - pos, old_size - (pos & (old_size - 1)),
+        size - (pos & (size - 1)));
+    memcpy(mem + (pos & (size - 1)), old + (pos & (old_size - 1)), n);
   }
 
-  if (len >= GBLFIFO_SIZE - devp->curl) len = GBLFIFO_SIZE - devp->curl;
+  devp->mem = mem;
+  WRITE_ONCE(devp->size, size);
+  devp->shm->size = size;
+  /* marks past tail haven't been retired yet, they move over too */
+  gblfifo_retire(&devp->lanes[0], devp->shm->tail);
+  gblfifo_move_marks(&devp->lanes[0], marks, nr_marks);
+  devp->high_water = gblfifo_len(devp);
+  mutex_unlock(&devp->mutex);
+
+  vfree(old);
+  pr_debug("gblfifo%d: resized %u -> %u\n", devp->minor, old_size, size);
 
-  if (copy_from_user(devp->mem + devp->curl, buf, len)) {
-    ret = -EFAULT;
-  } else {
-    devp->curl += len;
-    wake_up_interruptible(&devp->r_wait);
+  /* growing makes room, shrinking may fail a record that no longer fits */
+  wake_up_interruptible_all(&devp->w_wait);
+  return 0;
+}
 
-    /* process async features */
-    if (devp->async_queue) {
-      kill_fasync(&devp->async_queue, SIGIO, POLL_IN);
-      klog("%s kill SIGIO\n", __func__);
+static long gblfifo_get_stats(
+    struct gblfifo_dev *devp, struct gblfifo_stats __user *ustats) {
+  struct gblfifo_stats stats = {};
+
+  mutex_lock(&devp->mutex);
+  stats.size = devp->size;
+  stats.len = gblfifo_len(devp);
+  stats.high_water = devp->high_water;
+  stats.full_waits = devp->full_waits;
+  stats.dropped_bytes = devp->dropped_bytes;
+  stats.dropped_records = devp->dropped_records;
+  mutex_unlock(&devp->mutex);
+
+  return copy_to_user(ustats, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+static void gblfifo_fill_lanes(
+    struct gblfifo_dev *devp, struct gblfifo_lanes *lanes) {
+  struct gblfifo_lane_stats *st;
+  struct gblfifo_lane *l;
+  unsigned i;
+
+  memset(lanes, 0, sizeof(*lanes));
+  mutex_lock(&devp->mutex);
+  gblfifo_retire(&devp->lanes[0], devp->shm->tail);
+  lanes->bulk_weight = devp->bulk_weight;
+  for (i = 0; i < GBLFIFO_NR_LANES; i++) {
+    st = &lanes->lane[i];
+    l = &devp->lanes[i];
+    st->size = i ? devp->lane_size : devp->size;
+    st->len = gblfifo_lane_len(devp, i);
+    st->high_water = i ? l->high_water : devp->high_water;
+    st->msgs = l->msgs;
+    st->wait_ns = l->wait_ns;
+    st->max_wait_ns = l->max_wait_ns;
+  }
+  mutex_unlock(&devp->mutex);
+}
+
+static long gblfifo_get_lanes(
+    struct gblfifo_dev *devp, struct gblfifo_lanes __user *ulanes) {
+  struct gblfifo_lanes lanes;
+
+  gblfifo_fill_lanes(devp, &lanes);
+  return copy_to_user(ulanes, &lanes, sizeof(lanes)) ? -EFAULT : 0;
+}
+
+static void gblfifo_free_spill(struct gblfifo_spill_file *sp) {
+  if (!sp) return;
+  fput(sp->filp);
+  vfree(sp->buf);
+  vfree(sp->wbuf);
+  kfree(sp);
+}
+
+/*
+ * spill_work looks devp->spill up under the mutex and only lets go of it
+ * there, as do writers waiting for a handover. Unless one of them is still
+ * on it, the file it replaces can go as soon as the mutex is dropped.
+ */
+static long gblfifo_set_spill(
+    struct gblfifo_dev *devp, struct gblfifo_spill __user *uspill) {
+  struct gblfifo_spill spill;
+  struct gblfifo_spill_file *sp = NULL, *old;
+  long ret = 0;
+
+  if (copy_from_user(&spill, uspill, sizeof(spill))) return -EFAULT;
+
+  if (spill.fd >= 0) {
+    sp = kzalloc(sizeof(*sp), GFP_KERNEL);
+    if (!sp) return -ENOMEM;
+    sp->filp = fget(spill.fd);
+    if (!sp->filp) {
+      kfree(sp);
+      return -EBADF;
     }
+    sp->max_bytes = spill.max_bytes;
+    /* reads and writes go to explicit offsets */
+    if (!S_ISREG(file_inode(sp->filp)->i_mode) ||
+        (sp->filp->f_flags & O_APPEND))
+      ret = -EINVAL;
+    else if (!(sp->filp->f_mode & FMODE_READ) ||
+             !(sp->filp->f_mode & FMODE_WRITE))
+      ret = -EBADF;
+    if (ret) goto out;
+  }
 
-    ret = len;
+  mutex_lock(&devp->mutex);
+  if (sp && (devp->mode & (GBLFIFO_MODE_BROADCAST | GBLFIFO_MODE_OVERWRITE |
+                              GBLFIFO_MODE_PERCPU)))
+    ret = -EINVAL;
+  else if ((sp && atomic_read(&devp->nr_maps)) || gblfifo_spilling(devp) ||
+           (devp->spill && (devp->spill->busy || devp->spill->nr_waiting)))
+    ret = -EBUSY;
+  if (ret == 0 && sp) {
+    sp->chunk = max_t(size_t, GBLFIFO_SPILL_CHUNK, devp->size);
+    sp->buf = vmalloc(sp->chunk);
+    sp->wbuf = vmalloc(sp->chunk);
+    if (!sp->buf || !sp->wbuf) ret = -ENOMEM;
   }
+  if (ret == 0) {
+    old = devp->spill;
+    devp->spill = sp;
+    sp = old;
+  }
+  mutex_unlock(&devp->mutex);
 
+  if (ret == 0) {
+    pr_debug("gblfifo%d: spill file %s\n", devp->minor,
+        spill.fd >= 0 ? "set" : "detached");
+    /* writers waiting for room can go to the file now */
+    wake_up_interruptible_all(&devp->w_wait);
+  }
 out:
-  remove_wait_queue(&devp->w_wait, &wait);
-  mutex_unlock(&devp->mutex);
-  set_current_state(TASK_RUNNING);
+  gblfifo_free_spill(sp);
   return ret;
 }
 
-static loff_t gblfifo_llseek(struct file *filp, loff_t offset, int orig) {
-  return -EINVAL;
+static long gblfifo_get_spill(
+    struct gblfifo_dev *devp, struct gblfifo_spill_stats __user *ustats) {
+  struct gblfifo_spill_stats stats = {};
+  struct gblfifo_spill_file *sp;
+
+  mutex_lock(&devp->mutex);
+  sp = devp->spill;
+  if (sp) {
+    stats.active = 1;
+    stats.error = sp->err;
+    stats.max_bytes = sp->max_bytes;
+    stats.len = sp->len;
+    stats.high_water = sp->high_water;
+    stats.spilled = sp->spilled;
+  }
+  mutex_unlock(&devp->mutex);
+
+  return copy_to_user(ustats, &stats, sizeof(stats)) ? -EFAULT : 0;
+}
+
+static long gblfifo_set_sigio(
+    struct gblfifo_dev *devp, struct gblfifo_sigio __user *usigio) {
+  struct gblfifo_sigio sigio;
+
+  if (copy_from_user(&sigio, usigio, sizeof(sigio))) return -EFAULT;
+
+  mutex_lock(&devp->mutex);
+  devp->sigio = sigio;
+  devp->sigio_bytes = 0;
+  devp->sigio_last = jiffies;
+  mutex_unlock(&devp->mutex);
+  return 0;
+}
+
+static long gblfifo_set_lowat(
+    struct gblfifo_file *fp, struct gblfifo_lowat __user *ulowat) {
+  struct gblfifo_dev *devp = fp->devp;
+  struct gblfifo_lowat lowat;
+
+  if (copy_from_user(&lowat, ulowat, sizeof(lowat))) return -EFAULT;
+  /* a watermark above the ring size could never be reached */
+  mutex_lock(&devp->mutex);
+  if (lowat.rcvlowat > devp->size || lowat.sndlowat > devp->size) {
+    mutex_unlock(&devp->mutex);
+    return -EINVAL;
+  }
+  fp->rcvlowat = max(lowat.rcvlowat, 1u);
+  fp->sndlowat = max(lowat.sndlowat, 1u);
+  fp->timeout_ms = lowat.timeout_ms;
+  gblfifo_reset_timer(fp);
+  gblfifo_update_lowat(devp);
+  mutex_unlock(&devp->mutex);
+
+  /* let sleepers of this file pick up the new watermarks */
+  wake_up_interruptible_all(&devp->r_wait);
+  wake_up_interruptible_all(&devp->w_wait);
+  return 0;
+}
+
+static long gblfifo_get_lowat(
+    struct gblfifo_file *fp, struct gblfifo_lowat __user *ulowat) {
+  struct gblfifo_lowat lowat = {
+      .rcvlowat = fp->rcvlowat,
+      .sndlowat = fp->sndlowat,
+      .timeout_ms = fp->timeout_ms,
+  };
+
+  return copy_to_user(ulowat, &lowat, sizeof(lowat)) ? -EFAULT : 0;
 }
 
 static long gblfifo_ioctl(
     struct file *filp, unsigned int cmd, unsigned long arg) {
-  struct gblfifo_dev *devp = filp->private_data;
+  struct gblfifo_file *fp = filp->private_data;
+  struct gblfifo_dev *devp = fp->devp;
+  struct gblfifo_file *reader;
   switch (cmd) {
   case FIFO_CLEAR:
     mutex_lock(&devp->mutex);
-    devp->curl = 0;
+    /*
+     * catch tail and the cursors up rather than zero both indices, so
+     * lockless poll, the nonblocking paths and a peer on the mapping never
+     * see the new head next to the old tail
+     */
+    list_for_each_entry(reader, &devp->readers, node) {
+      WRITE_ONCE(reader->cursor, devp->shm->head);
+    }
+    smp_store_release(&devp->shm->tail, devp->shm->head);
+    devp->high_water = 0;
+    devp->full_waits = 0;
+    devp->dropped_bytes = devp->dropped_records = 0;
+    gblfifo_clear_lanes(devp);
+    gblfifo_clear_shards(devp);
+    if (devp->spill) gblfifo_clear_spill(devp->spill);
+    mutex_unlock(&devp->mutex);
+    wake_up_interruptible(&devp->w_wait);
+    break;
+  case GBLFIFO_KICK:
+    wake_up_interruptible(&devp->r_wait);
+    wake_up_interruptible(&devp->w_wait);
+    if (gblfifo_len(devp) != 0 && devp->async_queue)
+      kill_fasync(&devp->async_queue, SIGIO, POLL_IN);
+    break;
+  case GBLFIFO_SET_MODE: return gblfifo_set_mode(devp, arg);
+  case GBLFIFO_GET_MODE: return devp->mode;
+  case GBLFIFO_RECV_BATCH:
+    return gblfifo_recv_batch(
+        filp, (struct gblfifo_batch __user *)arg, NULL);
+  case GBLFIFO_SET_LOWAT:
+    return gblfifo_set_lowat(fp, (struct gblfifo_lowat __user *)arg);
+  case GBLFIFO_GET_LOWAT:
+    return gblfifo_get_lowat(fp, (struct gblfifo_lowat __user *)arg);
+  case GBLFIFO_SET_SIGIO:
+    return gblfifo_set_sigio(devp, (struct gblfifo_sigio __user *)arg);
+  case GBLFIFO_GET_SIGIO:
+    return copy_to_user((struct gblfifo_sigio __user *)arg, &devp->sigio,
+               sizeof(devp->sigio))
+               ? -EFAULT
+               : 0;
+  case GBLFIFO_SET_SIZE:
+    return gblfifo_resize(devp, arg);
+  case GBLFIFO_GET_STATS:
+    return gblfifo_get_stats(devp, (struct gblfifo_stats __user *)arg);
+  case GBLFIFO_SET_LANE:
+    if (arg >= GBLFIFO_NR_LANES) return -EINVAL;
+    WRITE_ONCE(fp->lane, arg);
+    break;
+  case GBLFIFO_GET_LANE: return fp->lane;
+  case GBLFIFO_SEND:
+    return gblfifo_send(filp, (struct gblfifo_send __user *)arg);
+  case GBLFIFO_SET_BULK_WEIGHT:
+    if (arg > UINT_MAX) return -EINVAL;
+    mutex_lock(&devp->mutex);
+    devp->bulk_weight = arg;
+    devp->bulk_skips = 0;
     mutex_unlock(&devp->mutex);
     break;
+  case GBLFIFO_GET_LANES:
+    return gblfifo_get_lanes(devp, (struct gblfifo_lanes __user *)arg);
+  case GBLFIFO_RECV_BATCH_TS:
+    return gblfifo_recv_batch_ts(
+        filp, (struct gblfifo_batch_ts __user *)arg);
+  case GBLFIFO_SET_SPILL:
+    return gblfifo_set_spill(devp, (struct gblfifo_spill __user *)arg);
+  case GBLFIFO_GET_SPILL:
+    return gblfifo_get_spill(devp, (struct gblfifo_spill_stats __user *)arg);
   default: return -EINVAL;
   }
   return 0;
 }
 
+/*
+ * Lockless, so pollers never queue up behind a copy in progress. The
+ * waitqueue lock taken by poll_wait orders our index loads after the
+ * registration, and every index update is followed by a wakeup or a
+ * wq_has_sleeper check, so a change we miss here still wakes us. A timer
+ * armed for data that is consumed meanwhile only lets the next read through
+ * early.
+ */
 static unsigned int gblfifo_poll(struct file *filp, poll_table *wait) {
   unsigned int mask = 0;
-  struct gblfifo_dev *devp = filp->private_data;
+  size_t room;
+  struct gblfifo_file *fp = filp->private_data;
+  struct gblfifo_dev *devp = fp->devp;
+  unsigned rcvlowat = READ_ONCE(fp->rcvlowat), lane;
 
-  mutex_lock(&devp->mutex);
   poll_wait(filp, &devp->r_wait, wait);
   poll_wait(filp, &devp->w_wait, wait);
 
-  if (devp->curl != 0) { mask |= POLLIN | POLLRDNORM; }
+  if (gblfifo_ready(fp, rcvlowat)) {
+    mask |= POLLIN | POLLRDNORM;
+  } else {
+    gblfifo_arm_timer(fp, rcvlowat);
+  }
 
-  if (devp->curl != GBLFIFO_SIZE) { mask |= POLLOUT | POLLWRNORM; }
+  lane = READ_ONCE(fp->lane);
+  if (lane) {
+    /* in broadcast mode a write fails right away */
+    if (gblfifo_broadcast(devp) ||
+        gblfifo_lane_room(devp, lane) > GBLFIFO_REC_HDR)
+      mask |= POLLOUT | POLLWRNORM;
+  } else if (gblfifo_percpu(devp)) {
+    /* the shard of the CPU we poll on, a write may run elsewhere */
+    if (gblfifo_shard_room(devp,
+            READ_ONCE(devp->shards)[raw_smp_processor_id()]) >
+        gblfifo_shard_hdr(devp))
+      mask |= POLLOUT | POLLWRNORM;
+  } else {
+    /* in record mode there must be room for at least a header and a byte */
+    room = gblfifo_room(devp);
+    if (gblfifo_overwrite(devp) || READ_ONCE(devp->spill) ||
+        room >= max_t(size_t, READ_ONCE(fp->sndlowat),
+                    (gblfifo_record(devp) ? GBLFIFO_REC_HDR : 0) + 1))
+      mask |= POLLOUT | POLLWRNORM;
+  }
 
-  mutex_unlock(&devp->mutex);
   return mask;
 }
 
+static void gblfifo_vm_open(struct vm_area_struct *vma) {
+  struct gblfifo_dev *devp = vma->vm_private_data;
+  atomic_inc(&devp->nr_maps);
+}
+
+static void gblfifo_vm_close(struct vm_area_struct *vma) {
+  struct gblfifo_dev *devp = vma->vm_private_data;
+  atomic_dec(&devp->nr_maps);
+}
+
+static const struct vm_operations_struct gblfifo_vm_ops = {
+    .open = gblfifo_vm_open,
+    .close = gblfifo_vm_close,
+};
+
+/* the shm page followed by the ring, mapping a prefix of that is fine */
+static int gblfifo_mmap(struct file *filp, struct vm_area_struct *vma) {
+  struct gblfifo_file *fp = filp->private_data;
+  struct gblfifo_dev *devp = fp->devp;
+  unsigned long len = vma->vm_end - vma->vm_start;
+  int ret;
+
+  if (!(vma->vm_flags & VM_SHARED) || vma->vm_pgoff) return -EINVAL;
+
+  mutex_lock(&devp->mutex);
+  /* a peer writing to the ring would overtake the spilled data */
+  if (gblfifo_broadcast(devp) || gblfifo_record(devp) ||
+      gblfifo_overwrite(devp) || devp->spill) {
+    ret = -EBUSY;
+  } else if (len > PAGE_SIZE + PAGE_ALIGN(devp->size)) {
+    ret = -EINVAL;
+  } else {
+    ret = remap_vmalloc_range_partial(
+        vma, vma->vm_start, devp->shm, PAGE_SIZE);
+    if (ret == 0 && len > PAGE_SIZE)
+      ret = remap_vmalloc_range_partial(
+          vma, vma->vm_start + PAGE_SIZE, devp->mem, len - PAGE_SIZE);
+  }
+  if (ret == 0) {
+    vma->vm_ops = &gblfifo_vm_ops;
+    vma->vm_private_data = devp;
+    gblfifo_vm_open(vma);
+  }
+  mutex_unlock(&devp->mutex);
+
+  return ret;
+}
+
 /* process FASYNC flag changing */
 static int gblfifo_fasync(int fd, struct file *filp, int mode) {
-  struct gblfifo_dev *devp = filp->private_data;
-  return fasync_helper(fd, filp, mode, &devp->async_queue);
+  struct gblfifo_file *fp = filp->private_data;
+  return fasync_helper(fd, filp, mode, &fp->devp->async_queue);
 }
 
 static int gblfifo_release(struct inode *inode, struct file *filp) {
+  struct gblfifo_file *fp = filp->private_data;
+  struct gblfifo_dev *devp = fp->devp;
+
   gblfifo_fasync(-1, filp, 0);
+  del_timer_sync(&fp->timer);
+
+  mutex_lock(&devp->mutex);
+  list_del(&fp->entry);
+  gblfifo_update_lowat(devp);
+  if (!list_empty(&fp->node)) {
+    list_del(&fp->node);
+    /* a departing slow reader frees up space */
+    if (gblfifo_broadcast(devp)) {
+      gblfifo_update_tail(devp);
+      wake_up_interruptible(&devp->w_wait);
+    }
+  }
+  mutex_unlock(&devp->mutex);
+
+  mutex_lock(&gblfifo_idr_lock);
+  devp->nr_open--;
+  mutex_unlock(&gblfifo_idr_lock);
+
+  kfree(fp);
   return 0;
 }
 
 static const struct file_operations gblfifo_ops = {
     .owner = THIS_MODULE,
     .open = gblfifo_open,
-    .read = gblfifo_read,
-    .write = gblfifo_write,
+    .read_iter = gblfifo_read_iter,
+    .write_iter = gblfifo_write_iter,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
     .llseek = gblfifo_llseek,
     .poll = gblfifo_poll,
+    .mmap = gblfifo_mmap,
     .unlocked_ioctl = gblfifo_ioctl,
 
     .release = gblfifo_release,
@@ -193,44 +2359,297 @@ static const struct file_operations gblfifo_ops = {
 #endif
 };
 
+/* the same numbers as GBLFIFO_GET_LANES, one line per lane */
+static int gblfifo_lanes_show(struct seq_file *m, void *v) {
+  struct gblfifo_lanes lanes;
+  struct gblfifo_lane_stats *st;
+
+  gblfifo_fill_lanes(m->private, &lanes);
+  seq_printf(m, "bulk_weight %u\n", lanes.bulk_weight);
+  seq_puts(m, "lane size len high_water msgs wait_ns max_wait_ns\n");
+  for (st = lanes.lane; st < lanes.lane + GBLFIFO_NR_LANES; st++)
+    seq_printf(m, "%td %u %u %u %llu %llu %llu\n", st - lanes.lane, st->size,
+        st->len, st->high_water, st->msgs, st->wait_ns, st->max_wait_ns);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gblfifo_lanes);
+
+/*
+ * one line per non-empty bucket, which runs up to twice its lower bound.
+ * merged msgs ran out of marks and were timed from an older write, so
+ * they sit in a bucket at or above their own
+ */
+static int gblfifo_residency_show(struct seq_file *m, void *v) {
+  struct gblfifo_dev *devp = m->private;
+  unsigned i, b;
+
+  seq_puts(m, "lane ns msgs merged\n");
+  mutex_lock(&devp->mutex);
+  gblfifo_retire(&devp->lanes[0], devp->shm->tail);
+  for (i = 0; i < GBLFIFO_NR_LANES; i++) {
+    for (b = 0; b < GBLFIFO_HIST_BUCKETS; b++) {
+      if (devp->lanes[i].hist[b])
+        seq_printf(m, "%u %llu %llu %llu\n", i, gblfifo_hist_lo(b),
+            devp->lanes[i].hist[b], devp->lanes[i].merged[b]);
+    }
+  }
+  mutex_unlock(&devp->mutex);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gblfifo_residency);
+
+static int gblfifo_shards_show(struct seq_file *m, void *v) {
+  struct gblfifo_dev *devp = m->private;
+  struct gblfifo_shard **shards = READ_ONCE(devp->shards);
+  int cpu;
+
+  seq_printf(m, "size %u seq %lld next_seq %llu\n", devp->shard_size,
+      atomic64_read(&devp->seq), READ_ONCE(devp->next_seq));
+  seq_puts(m, "cpu len msgs\n");
+  if (!shards) return 0;
+  for_each_possible_cpu(cpu)
+    seq_printf(m, "%d %u %llu\n", cpu, gblfifo_shard_len(devp, shards[cpu]),
+        shards[cpu]->msgs);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(gblfifo_shards);
+
+/* counters are read racily, good enough for watching a running system */
+static void gblfifo_debugfs_init(struct gblfifo_dev *devp) {
+  char name[16];
+
+  snprintf(name, sizeof(name), "%d", devp->minor);
+  devp->debugfs = debugfs_create_dir(name, gblfifo_debugfs);
+  debugfs_create_u32("size", 0444, devp->debugfs, &devp->size);
+  debugfs_create_u32("high_water", 0444, devp->debugfs, &devp->high_water);
+  debugfs_create_u64("full_waits", 0444, devp->debugfs, &devp->full_waits);
+  debugfs_create_u64(
+      "dropped_bytes", 0444, devp->debugfs, &devp->dropped_bytes);
+  debugfs_create_u64(
+      "dropped_records", 0444, devp->debugfs, &devp->dropped_records);
+  debugfs_create_file(
+      "lanes", 0444, devp->debugfs, devp, &gblfifo_lanes_fops);
+  debugfs_create_file(
+      "residency", 0444, devp->debugfs, devp, &gblfifo_residency_fops);
+  debugfs_create_file(
+      "shards", 0444, devp->debugfs, devp, &gblfifo_shards_fops);
+}
+
+static void gblfifo_free(struct gblfifo_dev *devp) {
+  unsigned i;
+
+  cancel_work_sync(&devp->spill_work);
+  gblfifo_free_spill(devp->spill);
+  for (i = 1; i < GBLFIFO_NR_LANES; i++) vfree(devp->lanes[i].mem);
+  for (i = 0; i < GBLFIFO_NR_LANES; i++) kvfree(devp->lanes[i].marks);
+  gblfifo_free_shards(devp);
+  percpu_free_rwsem(&devp->shard_sem);
+  vfree(devp->mem);
+  vfree(devp->shm);
+  vfree(devp);
+}
+
+/* returns the minor of the new instance, a size of 0 picks the default */
+static int gblfifo_create(unsigned long size) {
+  struct gblfifo_dev *devp;
+  struct device *dev;
+  unsigned long lsize;
+  unsigned i;
+  int err_code;
+
+  devp = vzalloc(sizeof(struct gblfifo_dev));
+  if (!devp) return -ENOMEM;
+
+  BUILD_BUG_ON(sizeof(struct gblfifo_shm) > PAGE_SIZE);
+  devp->shm = vmalloc_user(PAGE_SIZE);
+  if (!devp->shm) {
+    err_code = -ENOMEM;
+    goto error_malloc_shm;
+  }
+  if (size == 0) size = ring_size;
+  devp->mem = gblfifo_alloc_ring(&size);
+  if (IS_ERR(devp->mem)) {
+    err_code = PTR_ERR(devp->mem);
+    goto error_malloc_mem;
+  }
+  devp->size = size;
+  devp->shm->size = size;
+  devp->shm->data_offset = PAGE_SIZE;
+
+  for (i = 1; i < GBLFIFO_NR_LANES; i++) {
+    lsize = lane_size;
+    devp->lanes[i].mem = gblfifo_alloc_ring(&lsize);
+    if (IS_ERR(devp->lanes[i].mem)) {
+      err_code = PTR_ERR(devp->lanes[i].mem);
+      devp->lanes[i].mem = NULL;
+      goto error_malloc_lanes;
+    }
+    devp->lane_size = lsize;
+  }
+  for (i = 0; i < GBLFIFO_NR_LANES; i++) {
+    devp->lanes[i].marks = gblfifo_alloc_marks(
+        i ? devp->lane_size : devp->size, &devp->lanes[i].nr_marks);
+    if (!devp->lanes[i].marks) {
+      err_code = -ENOMEM;
+      goto error_malloc_lanes;
+    }
+  }
+  devp->bulk_weight = GBLFIFO_BULK_WEIGHT;
+
+  err_code = percpu_init_rwsem(&devp->shard_sem);
+  if (err_code) goto error_malloc_lanes;
+
+  mutex_init(&devp->mutex);
+  init_waitqueue_head(&devp->r_wait);
+  init_waitqueue_head(&devp->w_wait);
+  INIT_WORK(&devp->spill_work, gblfifo_spill_work);
+  INIT_LIST_HEAD(&devp->readers);
+  INIT_LIST_HEAD(&devp->files);
+  INIT_LIST_HEAD(&devp->rcv_sleepers);
+  INIT_LIST_HEAD(&devp->snd_sleepers);
+  devp->rcv_sleep_min = devp->snd_sleep_min = UINT_MAX;
+  gblfifo_update_lowat(devp);
+
+  mutex_lock(&gblfifo_idr_lock);
+  devp->minor = idr_alloc(&gblfifo_idr, devp, 0, GBLFIFO_MAX_DEVS, GFP_KERNEL);
+  if (devp->minor < 0) {
+    err_code = devp->minor == -ENOSPC ? -EMFILE : devp->minor;
+    goto error_idr_alloc;
+  }
+  dev = device_create(gblfifo_class, NULL,
+      MKDEV(MAJOR(gblfifo_devt), devp->minor), NULL, "gblfifo%d", devp->minor);
+  if (IS_ERR(dev)) {
+    err_code = PTR_ERR(dev);
+    goto error_device_create;
+  }
+  gblfifo_debugfs_init(devp);
+  mutex_unlock(&gblfifo_idr_lock);
+
+  pr_debug("gblfifo%d: created, %lu bytes\n", devp->minor, size);
+  return devp->minor;
+
+error_device_create:
+  idr_remove(&gblfifo_idr, devp->minor);
+
+error_idr_alloc:
+  mutex_unlock(&gblfifo_idr_lock);
+  percpu_free_rwsem(&devp->shard_sem);
+
+error_malloc_lanes:
+  for (i = 0; i < GBLFIFO_NR_LANES; i++) kvfree(devp->lanes[i].marks);
+  for (i = 1; i < GBLFIFO_NR_LANES; i++) vfree(devp->lanes[i].mem);
+  vfree(devp->mem);
+
+error_malloc_mem:
+  vfree(devp->shm);
+
+error_malloc_shm:
+  vfree(devp);
+  return err_code;
+}
+
+static int gblfifo_destroy(int minor) {
+  struct gblfifo_dev *devp;
+
+  mutex_lock(&gblfifo_idr_lock);
+  devp = idr_find(&gblfifo_idr, minor);
+  if (!devp || devp->nr_open) {
+    mutex_unlock(&gblfifo_idr_lock);
+    return devp ? -EBUSY : -ENOENT;
+  }
+  idr_remove(&gblfifo_idr, minor);
+  debugfs_remove_recursive(devp->debugfs);
+  device_destroy(gblfifo_class, MKDEV(MAJOR(gblfifo_devt), minor));
+  mutex_unlock(&gblfifo_idr_lock);
+
+  gblfifo_free(devp);
+  pr_debug("gblfifo%d: destroyed\n", minor);
+  return 0;
+}
+
+static long gblfifo_ctl_ioctl(
+    struct file *filp, unsigned int cmd, unsigned long arg) {
+  /* each instance pins up to 64 MiB of vmalloc, not for everyone to ask */
+  if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+
+  switch (cmd) {
+  case GBLFIFO_CTL_CREATE: return gblfifo_create(arg);
+  case GBLFIFO_CTL_DESTROY: return gblfifo_destroy(arg);
+  default: return -EINVAL;
+  }
+}
+
+static const struct file_operations gblfifo_ctl_ops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = gblfifo_ctl_ioctl,
+};
+
+static struct miscdevice gblfifo_ctl = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "gblfifo_ctl",
+    .fops = &gblfifo_ctl_ops,
+    .mode = 0600,
+};
+
+static void gblfifo_destroy_all(void) {
+  struct gblfifo_dev *devp;
+  int minor;
+
+  idr_for_each_entry(&gblfifo_idr, devp, minor) gblfifo_destroy(minor);
+}
+
 static int __init gblfifo_init(void) {
   int err_code = 0;
-  dev_t dev = MKDEV(GBLFIFO_MAJOR, 0);
-  gblfifo_devp = vzalloc(sizeof(struct gblfifo_dev));
-
-  if (!gblfifo_devp) goto error_malloc;
+  unsigned i;
 
-  err_code = register_chrdev_region(dev, 1, "gblfifo");
-  if (err_code < 0) goto error_register_region;
+  err_code = alloc_chrdev_region(&gblfifo_devt, 0, GBLFIFO_MAX_DEVS, "gblfifo");
+  if (err_code < 0) return err_code;
 
-  cdev_init(&gblfifo_devp->cdev, &gblfifo_ops);
-  gblfifo_devp->cdev.owner = THIS_MODULE;
-  err_code = cdev_add(&gblfifo_devp->cdev, dev, 1);
+  /* one cdev for all minors, open looks the instance up */
+  cdev_init(&gblfifo_cdev, &gblfifo_ops);
+  gblfifo_cdev.owner = THIS_MODULE;
+  err_code = cdev_add(&gblfifo_cdev, gblfifo_devt, GBLFIFO_MAX_DEVS);
   if (err_code < 0) goto error_cdev_add;
 
-  mutex_init(&gblfifo_devp->mutex);
-  init_waitqueue_head(&gblfifo_devp->r_wait);
-  init_waitqueue_head(&gblfifo_devp->w_wait);
+  gblfifo_class = class_create(THIS_MODULE, "gblfifo");
+  if (IS_ERR(gblfifo_class)) {
+    err_code = PTR_ERR(gblfifo_class);
+    goto error_class_create;
+  }
+  gblfifo_debugfs = debugfs_create_dir("gblfifo", NULL);
+
+  for (i = 0; i < nr_devs; i++) {
+    err_code = gblfifo_create(0);
+    if (err_code < 0) goto error_create;
+  }
+
+  err_code = misc_register(&gblfifo_ctl);
+  if (err_code < 0) goto error_create;
 
   return 0;
 
-error_cdev_add:
-  klog("Fail to invoke cdev_add\n");
+error_create:
+  gblfifo_destroy_all();
+  debugfs_remove_recursive(gblfifo_debugfs);
+  class_destroy(gblfifo_class);
 
-error_register_region:
-  vfree(gblfifo_devp);
-  return err_code;
+error_class_create:
+  cdev_del(&gblfifo_cdev);
 
-error_malloc:
-  return -ENOMEM;
+error_cdev_add:
+  klog("Fail to set up gblfifo: %d\n", err_code);
+  unregister_chrdev_region(gblfifo_devt, GBLFIFO_MAX_DEVS);
+  return err_code;
 }
 
 static void __exit gblfifo_exit(void) {
-  if (gblfifo_devp) {
-    cdev_del(&gblfifo_devp->cdev);
-    vfree(gblfifo_devp);
-  }
-  unregister_chrdev_region(MKDEV(GBLFIFO_MAJOR, 0), 1);
+  misc_deregister(&gblfifo_ctl);
+  gblfifo_destroy_all();
+  idr_destroy(&gblfifo_idr);
+  debugfs_remove_recursive(gblfifo_debugfs);
+  class_destroy(gblfifo_class);
+  cdev_del(&gblfifo_cdev);
+  unregister_chrdev_region(gblfifo_devt, GBLFIFO_MAX_DEVS);
 }
 
 module_init(gblfifo_init);
@@ -0,0 +1,378 @@
+#ifndef GBLFIFO_H
+#define GBLFIFO_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define FIFO_CLEAR 1
+
+#define GBLFIFO_IOC_MAGIC 'F'
+
+/* wake the other side after publishing through the shared mapping */
+#define GBLFIFO_KICK _IO(GBLFIFO_IOC_MAGIC, 1)
+
+/* arg is a mask of GBLFIFO_MODE_*, GET_MODE returns the current mask */
+#define GBLFIFO_SET_MODE _IO(GBLFIFO_IOC_MAGIC, 2)
+#define GBLFIFO_GET_MODE _IO(GBLFIFO_IOC_MAGIC, 3)
+
+/*
+ * every open file gets its own read cursor and sees every byte written after
+ * it was opened; space is reclaimed once the slowest reader has passed it
+ */
+#define GBLFIFO_MODE_BROADCAST 0x1
+/*
+ * in broadcast mode, a writer that finds the ring full skips the readers
+ * holding it back instead of blocking; their next read fails with EPIPE
+ */
+#define GBLFIFO_MODE_DROP_LAGGING 0x2
+/*
+ * keep write boundaries like SOCK_SEQPACKET: a read returns one whole
+ * message and discards the part that does not fit into the buffer
+ */
+#define GBLFIFO_MODE_RECORD 0x4
+/*
+ * never block a writer: drop the oldest bytes, or the oldest whole records
+ * in record mode, to make room. Not allowed together with broadcast, see
+ * DROP_LAGGING for that.
+ */
+#define GBLFIFO_MODE_OVERWRITE 0x8
+/*
+ * many producers: lane 0 writes go to a ring of the shard_size module
+ * parameter per CPU, so writers on different CPUs share no lock or cache
+ * line. Readers drain all of them, taking records in no particular order
+ * across CPUs, only each CPU's own in order. Needs record mode, not with
+ * broadcast, overwrite or a spill file. Watermarks and SIGIO don't apply
+ * to the shards, and GET_STATS only covers the ring. Switching in or out
+ * fails with EBUSY while anything is queued.
+ */
+#define GBLFIFO_MODE_PERCPU 0x10
+/*
+ * with PERCPU, every write takes a number from one shared counter and
+ * readers get records strictly in that order, at the cost of the counter
+ */
+#define GBLFIFO_MODE_ORDERED 0x20
+
+struct gblfifo_batch {
+  __u64 buf;      /* payloads are stored back to back here */
+  __u64 lens;     /* __u32 array receiving the length of each message */
+  __u32 buf_len;
+  __u32 max_msgs; /* capacity of lens */
+  __u32 nr_msgs;  /* out: messages received */
+  __u32 bytes;    /* out: payload bytes stored in buf */
+};
+
+/* record mode only: receive many whole messages in one call */
+#define GBLFIFO_RECV_BATCH _IOWR(GBLFIFO_IOC_MAGIC, 4, struct gblfifo_batch)
+
+/*
+ * Per-file watermarks like SO_RCVLOWAT/SO_SNDLOWAT. A blocking read or
+ * RECV_BATCH and POLLIN wait for rcvlowat queued bytes, a blocking write and
+ * POLLOUT wait for sndlowat bytes of room; a read or write asking for less
+ * only waits for what it asked. Nonblocking calls take what there is. With
+ * timeout_ms set, a reader is let through at most that long after it first
+ * saw data below its watermark. 0 means one byte and no timeout. In record
+ * mode the counts include the u32 headers.
+ */
+struct gblfifo_lowat {
+  __u32 rcvlowat;
+  __u32 sndlowat;
+  __u32 timeout_ms;
+};
+
+#define GBLFIFO_SET_LOWAT _IOW(GBLFIFO_IOC_MAGIC, 5, struct gblfifo_lowat)
+#define GBLFIFO_GET_LOWAT _IOR(GBLFIFO_IOC_MAGIC, 6, struct gblfifo_lowat)
+
+/*
+ * arg is the new ring size in bytes, rounded up to a power of two. Queued
+ * data is kept, so it fails with EBUSY while more is queued than fits, or
+ * while the ring is mapped.
+ */
+#define GBLFIFO_SET_SIZE _IO(GBLFIFO_IOC_MAGIC, 7)
+
+struct gblfifo_stats {
+  __u32 size;       /* ring bytes */
+  __u32 len;        /* bytes queued now */
+  __u32 high_water; /* most bytes queued since the last resize or clear */
+  __u32 __pad;
+  __u64 full_waits; /* writes that found too little room to proceed */
+  __u64 dropped_bytes;   /* overwritten payload bytes */
+  __u64 dropped_records; /* overwritten records, record mode only */
+};
+
+#define GBLFIFO_GET_STATS _IOR(GBLFIFO_IOC_MAGIC, 8, struct gblfifo_stats)
+
+/*
+ * SIGIO (or the F_SETSIG signal, with si_fd and si_band set) is sent with
+ * POLL_IN when the FIFO goes from empty to non-empty and with POLL_OUT when
+ * it goes from full to non-full. While data stays queued, further writes
+ * only signal again once interval_ms has passed or bytes more bytes have
+ * been written since the last signal; 0 disables either.
+ */
+struct gblfifo_sigio {
+  __u32 interval_ms;
+  __u32 bytes;
+};
+
+#define GBLFIFO_SET_SIGIO _IOW(GBLFIFO_IOC_MAGIC, 9, struct gblfifo_sigio)
+#define GBLFIFO_GET_SIGIO _IOR(GBLFIFO_IOC_MAGIC, 10, struct gblfifo_sigio)
+
+/*
+ * Priority lanes. Lane 0 is the ring above, lanes 1 .. GBLFIFO_NR_LANES - 1
+ * are small kernel-only rings for latency sensitive messages, a higher lane
+ * is drained first. Every write to a priority lane is one message, queued
+ * whole or not at all: in record mode a read returns it like a record, in
+ * stream mode a short read leaves the rest for the next one. A read never
+ * spans lanes, and RECV_BATCH takes its messages from one lane. Priority
+ * lanes are not available in broadcast mode and are not part of the shared
+ * mapping.
+ */
+#define GBLFIFO_NR_LANES 4
+
+/* arg is the lane later writes on this file go to, GET_LANE returns it */
+#define GBLFIFO_SET_LANE _IO(GBLFIFO_IOC_MAGIC, 11)
+#define GBLFIFO_GET_LANE _IO(GBLFIFO_IOC_MAGIC, 12)
+
+/* a single write to lane, whatever the file's lane is; returns len */
+struct gblfifo_send {
+  __u64 buf;
+  __u32 len;
+  __u32 lane;
+};
+
+#define GBLFIFO_SEND _IOW(GBLFIFO_IOC_MAGIC, 13, struct gblfifo_send)
+
+/*
+ * While lane 0 has data for a reader, it gets every (arg + 1)th read that
+ * priority lanes are competing for; 0 starves it until they are empty.
+ * Applies to the whole instance, the default is 8.
+ */
+#define GBLFIFO_SET_BULK_WEIGHT _IO(GBLFIFO_IOC_MAGIC, 14)
+
+/*
+ * Wait times run from the write to the read that consumed its last byte,
+ * for lane 0 also to the byte being overwritten or passed by a peer on the
+ * shared mapping, which is only noticed on the next read or write. Only
+ * writes made while the tstamp module parameter is on are counted, the
+ * debugfs residency file has their log2 histogram, with a merged count of
+ * those timed from an older write as described for RECV_BATCH_TS.
+ */
+struct gblfifo_lane_stats {
+  __u32 size;       /* ring bytes */
+  __u32 len;        /* bytes queued now, headers included */
+  __u32 high_water; /* most bytes queued since the last clear */
+  __u32 __pad;
+  __u64 msgs;        /* writes that left the lane */
+  __u64 wait_ns;     /* their total time queued */
+  __u64 max_wait_ns; /* the longest of those */
+};
+
+struct gblfifo_lanes {
+  __u32 bulk_weight;
+  __u32 __pad;
+  struct gblfifo_lane_stats lane[GBLFIFO_NR_LANES];
+};
+
+#define GBLFIFO_GET_LANES _IOR(GBLFIFO_IOC_MAGIC, 15, struct gblfifo_lanes)
+
+/*
+ * RECV_BATCH that also stores when each message was written, as
+ * CLOCK_MONOTONIC ns, into stamps, a __u64 array of batch.max_msgs. The
+ * kernel keeps a stamp per smallest record a ring can hold, up to 64Ki of
+ * them. Writes beyond that, such as many tiny stream writes, share the
+ * stamp of an earlier one, so a stamp is never later than its write.
+ * Writes made through the shared mapping get the stamp of the next
+ * write(), or 0 if there is none, as do all writes while the tstamp module
+ * parameter is off.
+ */
+struct gblfifo_batch_ts {
+  struct gblfifo_batch batch;
+  __u64 stamps;
+};
+
+#define GBLFIFO_RECV_BATCH_TS \
+  _IOWR(GBLFIFO_IOC_MAGIC, 16, struct gblfifo_batch_ts)
+
+/*
+ * Overflow into a file. fd is a regular file open for reading and writing,
+ * not O_APPEND. A write that finds the ring full, and every write after it
+ * until the file has drained, is appended to the file in chunks of at
+ * least 64 KiB instead, and moved back into the ring in order as readers
+ * make room, so readers see one FIFO. A write that would take the file
+ * past max_bytes (0 for no limit) fails with ENOSPC. The file is reused
+ * from its start whenever it drains, its old contents are overwritten.
+ * Only a kernel worker reads and writes the file. A write waits for it
+ * just when a whole chunk is still on its way to the file, a nonblocking
+ * one fails with EAGAIN then.
+ *
+ * fd -1 detaches the file. Setting or detaching fails with EBUSY while the
+ * current file holds data or the worker is in it. Not available in
+ * broadcast or overwrite mode or while the ring is mapped, and SET_SIZE
+ * fails while a file is set.
+ */
+struct gblfifo_spill {
+  __s32 fd;
+  __u32 __pad;
+  __u64 max_bytes;
+};
+
+#define GBLFIFO_SET_SPILL _IOW(GBLFIFO_IOC_MAGIC, 17, struct gblfifo_spill)
+
+struct gblfifo_spill_stats {
+  __u32 active; /* a file is set */
+  __s32 error;  /* a failed file read or write, spilling has stopped */
+  __u64 max_bytes;
+  __u64 len;        /* bytes waiting to go back into the ring */
+  __u64 high_water; /* most bytes waiting since the file was set */
+  __u64 spilled;    /* bytes that overflowed since then */
+};
+
+#define GBLFIFO_GET_SPILL \
+  _IOR(GBLFIFO_IOC_MAGIC, 18, struct gblfifo_spill_stats)
+
+/*
+ * On /dev/gblfifo_ctl: CREATE adds an instance with a ring of arg bytes (0
+ * for the module default) and returns its minor, it shows up as
+ * /dev/gblfifo<minor>. DESTROY removes the instance with minor arg, it
+ * fails with EBUSY while the instance is open. Both need CAP_SYS_ADMIN.
+ */
+#define GBLFIFO_CTL_CREATE _IO(GBLFIFO_IOC_MAGIC, 0x40)
+#define GBLFIFO_CTL_DESTROY _IO(GBLFIFO_IOC_MAGIC, 0x41)
+
+#define GBLFIFO_SHM_CACHELINE 64
+
+/*
+ * First page of an mmap of the device, the ring itself starts at data_offset.
+ * head is only advanced by the producer and tail only by the consumer, each
+ * on its own cache line. A side about to sleep sets its *_waiting flag so the
+ * other side knows it has to issue GBLFIFO_KICK after publishing.
+ */
+struct gblfifo_shm {
+  __u32 head;
+  __u32 r_waiting;
+  __u8 __pad0[GBLFIFO_SHM_CACHELINE - 8];
+  __u32 tail;
+  __u32 w_waiting;
+  __u8 __pad1[GBLFIFO_SHM_CACHELINE - 8];
+  __u32 size; /* ring bytes, a power of two */
+  __u32 data_offset;
+};
+
+#ifndef __KERNEL__
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Single-producer/single-consumer access to the ring without syscalls. Either
+ * side may also use read()/write() on the fd instead, but there must be only
+ * one producer and one consumer in total.
+ */
+struct gblfifo_ring {
+  int fd;
+  struct gblfifo_shm *shm;
+  unsigned char *data;
+  size_t map_size;
+};
+
+static inline int gblfifo_ring_map(struct gblfifo_ring *r, int fd) {
+  long page = sysconf(_SC_PAGESIZE);
+  struct gblfifo_shm *shm;
+  size_t map_size;
+
+  shm = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED) return -1;
+  map_size = shm->data_offset + shm->size;
+  munmap(shm, page);
+
+  shm = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED) return -1;
+
+  r->fd = fd;
+  r->shm = shm;
+  r->data = (unsigned char *)shm + shm->data_offset;
+  r->map_size = map_size;
+  return 0;
+}
+
+static inline void gblfifo_ring_unmap(struct gblfifo_ring *r) {
+  munmap(r->shm, r->map_size);
+}
+
+/* full fence so the flag check can't pass our index store, see ring_wait */
+static inline void gblfifo_ring_kick(struct gblfifo_ring *r, __u32 *waiting) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_RELAXED))
+    ioctl(r->fd, GBLFIFO_KICK, 0);
+}
+
+static inline size_t gblfifo_ring_write(
+    struct gblfifo_ring *r, const void *buf, size_t len) {
+  struct gblfifo_shm *shm = r->shm;
+  __u32 head = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+  __u32 tail = __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE);
+  size_t off = head & (shm->size - 1), n;
+
+  if (len > shm->size - (head - tail)) len = shm->size - (head - tail);
+  if (len == 0) return 0;
+
+  n = len < shm->size - off ? len : shm->size - off;
+  memcpy(r->data + off, buf, n);
+  memcpy(r->data, (const unsigned char *)buf + n, len - n);
+  __atomic_store_n(&shm->head, head + len, __ATOMIC_RELEASE);
+
+  gblfifo_ring_kick(r, &shm->r_waiting);
+  return len;
+}
+
+static inline size_t gblfifo_ring_read(
+    struct gblfifo_ring *r, void *buf, size_t len) {
+  struct gblfifo_shm *shm = r->shm;
+  __u32 tail = __atomic_load_n(&shm->tail, __ATOMIC_RELAXED);
+  __u32 head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+  size_t off = tail & (shm->size - 1), n;
+
+  if (len > head - tail) len = head - tail;
+  if (len == 0) return 0;
+
+  n = len < shm->size - off ? len : shm->size - off;
+  memcpy(buf, r->data + off, n);
+  memcpy((unsigned char *)buf + n, r->data, len - n);
+  __atomic_store_n(&shm->tail, tail + len, __ATOMIC_RELEASE);
+
+  gblfifo_ring_kick(r, &shm->w_waiting);
+  return len;
+}
+
+static inline int gblfifo_ring_ready(struct gblfifo_ring *r, short events) {
+  struct gblfifo_shm *shm = r->shm;
+  __u32 head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+  __u32 tail = __atomic_load_n(&shm->tail, __ATOMIC_ACQUIRE);
+
+  if (events & POLLIN) return head != tail;
+  return head - tail < shm->size;
+}
+
+/*
+ * Sleep until the ring is readable (POLLIN) or writable (POLLOUT). Setting
+ * the flag before the last check pairs with the fence in gblfifo_ring_kick,
+ * so either we see the new index or the other side sees the flag.
+ */
+static inline int gblfifo_ring_wait(
+    struct gblfifo_ring *r, short events, int timeout_ms) {
+  __u32 *flag = events & POLLIN ? &r->shm->r_waiting : &r->shm->w_waiting;
+  struct pollfd pfd = {.fd = r->fd, .events = events};
+  int ret = 0;
+
+  __atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!gblfifo_ring_ready(r, events)) ret = poll(&pfd, 1, timeout_ms);
+  __atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+
+  return ret < 0 ? -1 : 0;
+}
+#endif
+
+#endif
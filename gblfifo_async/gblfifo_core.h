@@ -0,0 +1,73 @@
+#ifndef GBLFIFO_CORE_H
+#define GBLFIFO_CORE_H
+
+/*
+ * Ring arithmetic and copies on a bare (mem, size) pair, size a power of
+ * two. The driver wraps these around its gblfifo_dev, kunit/gblfifo_test.c
+ * runs them on a kmalloc'ed ring.
+ */
+
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/uio.h>
+
+#define GBLFIFO_REC_HDR sizeof(u32)
+
+/* log2 residency buckets, the last one also takes everything longer */
+#define GBLFIFO_HIST_BUCKETS 40
+
+/* bucket b > 0 holds [2^(b-1), 2^b) ns, bucket 0 a wait of 0 */
+static inline unsigned gblfifo_hist_bucket(u64 ns) {
+  return min_t(unsigned, fls64(ns), GBLFIFO_HIST_BUCKETS - 1);
+}
+
+static inline u64 gblfifo_hist_lo(unsigned bucket) {
+  return bucket ? 1ULL << (bucket - 1) : 0;
+}
+
+/* head - tail, clamped since a mapped peer may scribble on the indices */
+static inline unsigned gblfifo_used(unsigned head, unsigned tail,
+    unsigned size) {
+  return min_t(unsigned, head - tail, size);
+}
+
+static inline size_t gblfifo_mem_copy_to_iter(uint8_t *mem, unsigned size,
+    unsigned pos, size_t len, struct iov_iter *to) {
+  size_t off = pos & (size - 1);
+  size_t n = min_t(size_t, len, size - off);
+  size_t copied = copy_to_iter(mem + off, n, to);
+
+  /* the bytes may wrap around the end of mem */
+  if (copied == n && len > n) copied += copy_to_iter(mem, len - n, to);
+  return copied;
+}
+
+static inline size_t gblfifo_mem_copy_from_iter(uint8_t *mem, unsigned size,
+    unsigned pos, size_t len, struct iov_iter *from) {
+  size_t off = pos & (size - 1);
+  size_t n = min_t(size_t, len, size - off);
+  size_t copied = copy_from_iter(mem + off, n, from);
+
+  if (copied == n && len > n) copied += copy_from_iter(mem, len - n, from);
+  return copied;
+}
+
+/* record headers are only ever touched by the kernel */
+static inline u32 gblfifo_mem_peek_hdr(uint8_t *mem, unsigned size,
+    unsigned pos) {
+  u32 hdr;
+  size_t i;
+  for (i = 0; i < GBLFIFO_REC_HDR; i++)
+    ((u8 *)&hdr)[i] = mem[(pos + i) & (size - 1)];
+  return hdr;
+}
+
+static inline void gblfifo_mem_poke_hdr(uint8_t *mem, unsigned size,
+    unsigned pos, u32 hdr) {
+  size_t i;
+  for (i = 0; i < GBLFIFO_REC_HDR; i++)
+    mem[(pos + i) & (size - 1)] = ((u8 *)&hdr)[i];
+}
+
+#endif
@@ -0,0 +1,96 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gblfifo
+
+#if !defined(_GBLFIFO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GBLFIFO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Enable with e.g. "perf record -e gblfifo:*" or through
+ * /sys/kernel/tracing/events/gblfifo. A disabled event is a patched out
+ * branch, so these stay compiled in.
+ */
+
+DECLARE_EVENT_CLASS(gblfifo_data,
+  TP_PROTO(int minor, unsigned lane, unsigned pos, size_t len,
+      unsigned queued),
+  TP_ARGS(minor, lane, pos, len, queued),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(unsigned, lane)
+    __field(unsigned, pos)
+    __field(size_t, len)
+    __field(unsigned, queued)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->lane = lane;
+    __entry->pos = pos;
+    __entry->len = len;
+    __entry->queued = queued;
+  ),
+  TP_printk("minor=%d lane=%u pos=%u len=%zu queued=%u", __entry->minor,
+      __entry->lane, __entry->pos, __entry->len, __entry->queued)
+);
+
+/* pos is the lane's head before the bytes went in, queued counts them */
+DEFINE_EVENT(gblfifo_data, gblfifo_enqueue,
+  TP_PROTO(int minor, unsigned lane, unsigned pos, size_t len,
+      unsigned queued),
+  TP_ARGS(minor, lane, pos, len, queued)
+);
+
+/* pos is the reader's position before, queued what is left after */
+DEFINE_EVENT(gblfifo_data, gblfifo_dequeue,
+  TP_PROTO(int minor, unsigned lane, unsigned pos, size_t len,
+      unsigned queued),
+  TP_ARGS(minor, lane, pos, len, queued)
+);
+
+/* a reader waiting for need bytes or a writer for need bytes of room */
+TRACE_EVENT(gblfifo_block,
+  TP_PROTO(int minor, bool write, size_t need, unsigned have),
+  TP_ARGS(minor, write, need, have),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(bool, write)
+    __field(size_t, need)
+    __field(unsigned, have)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->write = write;
+    __entry->need = need;
+    __entry->have = have;
+  ),
+  TP_printk("minor=%d %s need=%zu have=%u", __entry->minor,
+      __entry->write ? "write" : "read", __entry->need, __entry->have)
+);
+
+/* the matching wakeup, ret is -ERESTARTSYS when a signal cut it short */
+TRACE_EVENT(gblfifo_wake,
+  TP_PROTO(int minor, bool write, int ret),
+  TP_ARGS(minor, write, ret),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(bool, write)
+    __field(int, ret)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->write = write;
+    __entry->ret = ret;
+  ),
+  TP_printk("minor=%d %s ret=%d", __entry->minor,
+      __entry->write ? "write" : "read", __entry->ret)
+);
+
+#endif
+
+/* the module is built out of tree, see CFLAGS_gblfifo.o in the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gblfifo_trace
+#include <trace/define_trace.h>
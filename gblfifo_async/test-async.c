@@ -1,20 +1,24 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <strings.h>
-#include <sys/epoll.h>
-#include <sys/select.h>
-#include <sys/syscall.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
-#define FIFO_CLEAR 0x1
+#include "gblfifo.h"
 
-static void sigio_handler(int signum) {
-  printf("receive a signal from gblfifo\n");
+/* with F_SETSIG the kernel tells us which fd fired and why */
+static void sigio_handler(int signum, siginfo_t *si, void *ctx) {
+  (void)ctx;
+  printf("receive signal %d from gblfifo: fd %d band %#lx\n", signum,
+         si->si_fd, (unsigned long)si->si_band);
 }
 
 int main(int argc, const char *argv[]) {
-  fd_set rfds, wfds;
+  struct sigaction sa;
+  struct gblfifo_sigio sigio = {.interval_ms = 1000};
 
   if (argc < 2) {
     printf("need gblfifo cdev file\n");
@@ -25,10 +29,17 @@ int main(int argc, const char *argv[]) {
   if (fd < 0) {
     perror("open");
   } else {
-    signal(SIGIO, sigio_handler);
+    bzero(&sa, sizeof(sa));
+    sa.sa_sigaction = sigio_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGRTMIN, &sa, NULL);
 
-    /* set ownership of fd */
+    /* set ownership of fd, and a queued real-time signal instead of SIGIO */
     fcntl(fd, F_SETOWN, getpid());
+    fcntl(fd, F_SETSIG, SIGRTMIN);
+
+    /* while data stays queued, signal at most once a second */
+    if (ioctl(fd, GBLFIFO_SET_SIGIO, &sigio) < 0) perror("ioctl");
 
     /* add flag FASYNC */
     int flags = fcntl(fd, F_GETFL, 0);
@@ -0,0 +1,62 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MSG 100
+#define CHUNK 10
+
+/*
+ * Fill the ring, then have a child block on a MSG-byte write while the
+ * parent drains CHUNK bytes at a time. A write of up to PIPE_BUF bytes is
+ * queued whole, so it waits for MSG bytes of room that only show up after
+ * several small reads, and has to be woken then.
+ */
+int main(int argc, const char *argv[]) {
+  char buf[MSG] = {0};
+  ssize_t n;
+  int status;
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR);
+  int nfd = open(argv[1], O_RDWR | O_NONBLOCK);
+  if (fd < 0 || nfd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  ioctl(fd, FIFO_CLEAR, 0);
+  while (write(nfd, buf, 1) == 1)
+    ;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* a lost wakeup leaves the child blocked, this kills it */
+    alarm(2);
+    n = write(fd, buf, MSG);
+    _exit(n == MSG ? 0 : 1);
+  }
+
+  for (int i = 0; i < MSG / CHUNK; i++) {
+    usleep(10000);
+    if (read(fd, buf, CHUNK) != CHUNK) perror("read");
+  }
+  waitpid(pid, &status, 0);
+
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    printf("%d-byte write after %d %d-byte reads: OK\n", MSG, MSG / CHUNK,
+           CHUNK);
+  else
+    printf("%d-byte write never completed: FAIL\n", MSG);
+
+  close(nfd);
+  close(fd);
+  return 0;
+}
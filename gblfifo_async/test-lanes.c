@@ -0,0 +1,75 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define BULK 8
+
+/*
+ * Queue bulk records, then a control message on the top lane. The control
+ * message is read first even though it was written last, and the bulk
+ * records follow in order.
+ */
+int main(int argc, const char *argv[]) {
+  struct gblfifo_lanes lanes;
+  struct gblfifo_send send;
+  char msg[32];
+  int n;
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0 ||
+      ioctl(fd, GBLFIFO_SET_MODE, GBLFIFO_MODE_RECORD) < 0) {
+    perror("ioctl");
+    return 0;
+  }
+
+  for (int i = 0; i < BULK; i++) {
+    int len = snprintf(msg, sizeof(msg), "bulk-%d", i);
+    if (write(fd, msg, len) != len) perror("write");
+  }
+
+  strcpy(msg, "control");
+  send.buf = (uintptr_t)msg;
+  send.len = strlen(msg);
+  send.lane = GBLFIFO_NR_LANES - 1;
+  if (ioctl(fd, GBLFIFO_SEND, &send) != (int)send.len) {
+    perror("ioctl.GBLFIFO_SEND");
+    return 0;
+  }
+
+  while ((n = read(fd, msg, sizeof(msg) - 1)) > 0) {
+    msg[n] = '\0';
+    printf("%s\n", msg);
+  }
+
+  if (ioctl(fd, GBLFIFO_GET_LANES, &lanes) < 0) {
+    perror("ioctl.GBLFIFO_GET_LANES");
+    return 0;
+  }
+  printf("bulk_weight %u\n", lanes.bulk_weight);
+  for (int i = 0; i < GBLFIFO_NR_LANES; i++) {
+    struct gblfifo_lane_stats *st = &lanes.lane[i];
+    printf("lane %d: %llu msgs, high water %u/%u, wait avg %llu max %llu ns\n",
+           i, (unsigned long long)st->msgs, st->high_water, st->size,
+           (unsigned long long)(st->msgs ? st->wait_ns / st->msgs : 0),
+           (unsigned long long)st->max_wait_ns);
+  }
+
+  ioctl(fd, GBLFIFO_SET_MODE, 0);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MSG 16
+#define MSGS 2000
+#define RCVLOWAT 512
+#define TIMEOUT_MS 20
+
+/*
+ * A child writes MSG-byte messages every 100us while the parent reads with
+ * a watermark. Without it, every read returns a single message; with it, a
+ * read returns about RCVLOWAT bytes, and the tail is still delivered within
+ * TIMEOUT_MS after the writer stops.
+ */
+static void run(const char *path, unsigned rcvlowat) {
+  struct gblfifo_lowat lowat = {.rcvlowat = rcvlowat, .timeout_ms = TIMEOUT_MS};
+  char buf[1024] = {0};
+  long total = 0, reads = 0;
+
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    return;
+  }
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0 ||
+      ioctl(fd, GBLFIFO_SET_LOWAT, &lowat) < 0) {
+    perror("ioctl");
+    return;
+  }
+
+  if (fork() == 0) {
+    for (int i = 0; i < MSGS; i++) {
+      if (write(fd, buf, MSG) != MSG) perror("write");
+      usleep(100);
+    }
+    _exit(0);
+  }
+
+  while (total < MSG * MSGS) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0) {
+      perror("read");
+      break;
+    }
+    total += n;
+    reads++;
+  }
+  wait(NULL);
+
+  printf("rcvlowat %4u: %ld bytes in %ld reads, %.1f bytes/read\n", rcvlowat,
+         total, reads, (double)total / reads);
+  close(fd);
+}
+
+static void on_alarm(int sig) {
+  (void)sig;
+  printf("short read: no wakeup, FAIL\n");
+  _exit(1);
+}
+
+/*
+ * A read of MSG bytes waits for min(rcvlowat, MSG), so a single message
+ * has to wake it even though the watermark is far away.
+ */
+static void short_read(const char *path) {
+  struct gblfifo_lowat lowat = {.rcvlowat = RCVLOWAT};
+  char buf[MSG] = {0};
+
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    return;
+  }
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0 ||
+      ioctl(fd, GBLFIFO_SET_LOWAT, &lowat) < 0) {
+    perror("ioctl");
+    return;
+  }
+
+  if (fork() == 0) {
+    usleep(100000);
+    if (write(fd, buf, MSG) != MSG) perror("write");
+    _exit(0);
+  }
+
+  signal(SIGALRM, on_alarm);
+  alarm(2);
+  ssize_t n = read(fd, buf, MSG);
+  alarm(0);
+  wait(NULL);
+
+  printf("short read: %zd bytes, %s\n", n, n == MSG ? "OK" : "FAIL");
+  close(fd);
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  run(argv[1], 0);
+  run(argv[1], RCVLOWAT);
+  short_read(argv[1]);
+  return 0;
+}
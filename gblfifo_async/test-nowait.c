@@ -0,0 +1,46 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+/*
+ * On a blocking fd, RWF_NOWAIT must fail with EAGAIN instead of sleeping,
+ * which is what lets io_uring arm poll rather than punt to a worker. A
+ * writev lands in one piece or not at all.
+ */
+int main(int argc, const char *argv[]) {
+  char a[] = "head-", b[] = "body-", c[] = "tail", buf[64];
+  struct iovec iov[] = {{a, 5}, {b, 5}, {c, 4}};
+  struct iovec riov = {buf, sizeof(buf)};
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+  ioctl(fd, FIFO_CLEAR, 0);
+
+  if (preadv2(fd, &riov, 1, -1, RWF_NOWAIT) < 0 && errno == EAGAIN)
+    printf("empty FIFO: RWF_NOWAIT read got EAGAIN\n");
+  else
+    printf("empty FIFO: RWF_NOWAIT read did not fail with EAGAIN\n");
+
+  if (writev(fd, iov, 3) != 14) perror("writev");
+
+  ssize_t n = preadv2(fd, &riov, 1, -1, RWF_NOWAIT);
+  printf("read %zd bytes: %.*s\n", n, (int)(n > 0 ? n : 0), buf);
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,61 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MSGS 1000
+
+/*
+ * Write far more records than fit with nobody reading. In overwrite mode no
+ * write blocks or fails, the oldest records are dropped and counted, and
+ * the reader finds the newest ones.
+ */
+int main(int argc, const char *argv[]) {
+  struct gblfifo_stats stats;
+  char msg[32];
+  int first = -1, last = -1, n;
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0 ||
+      ioctl(fd, GBLFIFO_SET_MODE,
+          GBLFIFO_MODE_RECORD | GBLFIFO_MODE_OVERWRITE) < 0) {
+    perror("ioctl");
+    return 0;
+  }
+
+  for (int i = 0; i < MSGS; i++) {
+    int len = snprintf(msg, sizeof(msg), "msg-%d", i);
+    if (write(fd, msg, len) != len) perror("write");
+  }
+
+  if (ioctl(fd, GBLFIFO_GET_STATS, &stats) < 0) {
+    perror("ioctl.GBLFIFO_GET_STATS");
+    return 0;
+  }
+
+  while ((n = read(fd, msg, sizeof(msg) - 1)) > 0) {
+    msg[n] = '\0';
+    sscanf(msg, "msg-%d", &last);
+    if (first < 0) first = last;
+  }
+
+  printf("kept msg-%d..msg-%d, dropped %llu records / %llu bytes\n", first,
+         last, (unsigned long long)stats.dropped_records,
+         (unsigned long long)stats.dropped_bytes);
+
+  ioctl(fd, GBLFIFO_SET_MODE, 0);
+  close(fd);
+  return 0;
+}
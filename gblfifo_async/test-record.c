@@ -0,0 +1,64 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MAX_MSGS 256
+
+int main(int argc, const char *argv[]) {
+  char buf[BUFSIZ], msg[32];
+  __u32 lens[MAX_MSGS];
+  int sent = 0, calls = 0, received = 0;
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0 ||
+      ioctl(fd, GBLFIFO_SET_MODE, GBLFIFO_MODE_RECORD) < 0) {
+    perror("ioctl");
+    return 0;
+  }
+
+  /* queue small messages of varying length until the FIFO is full */
+  for (;; sent++) {
+    int len = snprintf(msg, sizeof(msg), "msg-%d", sent);
+    if (write(fd, msg, len) < 0) break;
+  }
+
+  while (received < sent) {
+    struct gblfifo_batch batch = {
+        .buf = (__u64)(unsigned long)buf,
+        .lens = (__u64)(unsigned long)lens,
+        .buf_len = sizeof(buf),
+        .max_msgs = MAX_MSGS,
+    };
+
+    if (ioctl(fd, GBLFIFO_RECV_BATCH, &batch) < 0) {
+      perror("ioctl.GBLFIFO_RECV_BATCH");
+      break;
+    }
+
+    char *p = buf;
+    for (unsigned i = 0; i < batch.nr_msgs; i++, received++) {
+      if (strncmp(p, "msg-", 4)) printf("bad message %.*s\n", lens[i], p);
+      p += lens[i];
+    }
+    calls++;
+  }
+
+  printf("%d messages in %d calls\n", received, calls);
+  ioctl(fd, GBLFIFO_SET_MODE, 0);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MSG_SIZE 64
+#define NR_MSGS 1000000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* move NR_MSGS messages through the shared ring, no read()/write() at all */
+int main(int argc, const char *argv[]) {
+  struct gblfifo_ring ring;
+  char msg[MSG_SIZE] = {0};
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0) {
+    printf("ioctl 'FIFO_CLEAR' failed\n");
+    return 0;
+  }
+
+  if (gblfifo_ring_map(&ring, fd) < 0) {
+    perror("mmap");
+    return 0;
+  }
+
+  double start = now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (long i = 0; i < NR_MSGS; i++) {
+      size_t done = 0;
+      while (done < MSG_SIZE) {
+        done += gblfifo_ring_write(&ring, msg + done, MSG_SIZE - done);
+        if (done < MSG_SIZE) gblfifo_ring_wait(&ring, POLLOUT, -1);
+      }
+    }
+    exit(0);
+  }
+
+  long long left = (long long)NR_MSGS * MSG_SIZE;
+  while (left > 0) {
+    size_t n = gblfifo_ring_read(&ring, msg, sizeof(msg));
+    if (n == 0) gblfifo_ring_wait(&ring, POLLIN, -1);
+    left -= n;
+  }
+  waitpid(pid, NULL, 0);
+
+  double secs = now() - start;
+  printf("%d msgs of %d bytes in %.3fs: %.0f msgs/s\n", NR_MSGS, MSG_SIZE,
+      secs, NR_MSGS / secs);
+
+  gblfifo_ring_unmap(&ring);
+  close(fd);
+  return 0;
+}
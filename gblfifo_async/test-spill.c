@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MSGS 10000
+
+/*
+ * Write far more records than the ring holds with nobody reading. None of
+ * the writes blocks, one is retried while a full chunk is still being
+ * written out, the overflow waits in a temporary file, and the reader then
+ * gets every record back in order.
+ */
+int main(int argc, const char *argv[]) {
+  struct gblfifo_spill spill = {.fd = -1};
+  struct gblfifo_spill_stats stats;
+  char path[] = "/tmp/gblfifo-spill-XXXXXX";
+  char msg[32];
+  int next = 0, seq, n;
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  spill.fd = mkstemp(path);
+  if (spill.fd < 0) {
+    perror("mkstemp");
+    return 0;
+  }
+  unlink(path);
+
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0 ||
+      ioctl(fd, GBLFIFO_SET_MODE, GBLFIFO_MODE_RECORD) < 0 ||
+      ioctl(fd, GBLFIFO_SET_SPILL, &spill) < 0) {
+    perror("ioctl");
+    return 0;
+  }
+
+  for (int i = 0; i < MSGS; i++) {
+    int len = snprintf(msg, sizeof(msg), "msg-%d", i);
+    /* the previous chunk may still be on its way to the file */
+    while ((n = write(fd, msg, len)) < 0 && errno == EAGAIN) usleep(1000);
+    if (n != len) {
+      perror("write");
+      return 0;
+    }
+  }
+
+  if (ioctl(fd, GBLFIFO_GET_SPILL, &stats) < 0) {
+    perror("ioctl.GBLFIFO_GET_SPILL");
+    return 0;
+  }
+  printf("%llu bytes waiting in the file\n", (unsigned long long)stats.len);
+
+  /* the ring is refilled behind our back, wait for it when it runs dry */
+  while (next < MSGS) {
+    n = read(fd, msg, sizeof(msg) - 1);
+    if (n < 0) {
+      usleep(1000);
+      continue;
+    }
+    msg[n] = '\0';
+    if (sscanf(msg, "msg-%d", &seq) != 1 || seq != next) {
+      printf("expected msg-%d, got %s\n", next, msg);
+      return 0;
+    }
+    next++;
+  }
+
+  ioctl(fd, GBLFIFO_GET_SPILL, &stats);
+  printf("read all %d records in order, %llu bytes overflowed, at most "
+         "%llu at once\n",
+         MSGS, (unsigned long long)stats.spilled,
+         (unsigned long long)stats.high_water);
+
+  spill.fd = -1;
+  ioctl(fd, GBLFIFO_SET_SPILL, &spill);
+  ioctl(fd, GBLFIFO_SET_MODE, 0);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gblfifo.h"
+
+#define MSGS 8
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Write a record every 10ms, then take them all with RECV_BATCH_TS. The
+ * first one has been queued the longest, each later one about 10ms less.
+ */
+int main(int argc, const char *argv[]) {
+  struct gblfifo_batch_ts bts = {0};
+  uint64_t stamps[MSGS], now;
+  uint32_t lens[MSGS];
+  char buf[MSGS * 32], msg[32];
+
+  if (argc < 2) {
+    printf("need gblfifo cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  if (ioctl(fd, FIFO_CLEAR, 0) < 0 ||
+      ioctl(fd, GBLFIFO_SET_MODE, GBLFIFO_MODE_RECORD) < 0) {
+    perror("ioctl");
+    return 0;
+  }
+
+  for (int i = 0; i < MSGS; i++) {
+    int len = snprintf(msg, sizeof(msg), "msg-%d", i);
+    if (write(fd, msg, len) != len) perror("write");
+    usleep(10000);
+  }
+
+  bts.batch.buf = (uintptr_t)buf;
+  bts.batch.buf_len = sizeof(buf);
+  bts.batch.lens = (uintptr_t)lens;
+  bts.batch.max_msgs = MSGS;
+  bts.stamps = (uintptr_t)stamps;
+  if (ioctl(fd, GBLFIFO_RECV_BATCH_TS, &bts) < 0) {
+    perror("ioctl.GBLFIFO_RECV_BATCH_TS");
+    return 0;
+  }
+  now = now_ns();
+
+  char *p = buf;
+  for (unsigned i = 0; i < bts.batch.nr_msgs; i++) {
+    printf("%.*s queued %llu us\n", (int)lens[i], p,
+           stamps[i] ? (unsigned long long)(now - stamps[i]) / 1000 : 0ULL);
+    p += lens[i];
+  }
+
+  ioctl(fd, GBLFIFO_SET_MODE, 0);
+  close(fd);
+  return 0;
+}
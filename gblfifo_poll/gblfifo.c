@@ -8,16 +8,20 @@
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
 
 #define FIFO_CLEAR 1
 #define GBLFIFO_MAJOR 230
-#define GBLFIFO_SIZE 1024
+#define GBLFIFO_SIZE 1024 /* must be a power of two */
+#define GBLFIFO_MASK (GBLFIFO_SIZE - 1)
 
 #define klog(fmt, ...) \
   printk(KERN_INFO "%s:%d: " fmt, __func__, __LINE__, ##__VA_ARGS__)
 
+/* head and tail run freely, head - tail is the number of queued bytes */
 struct gblfifo_dev {
-  unsigned curl;
+  unsigned head;
+  unsigned tail;
   struct cdev cdev;
   struct mutex mutex;
   wait_queue_head_t r_wait;
@@ -27,6 +31,12 @@ struct gblfifo_dev {
 
 static struct gblfifo_dev *gblfifo_devp = NULL;
 
+/* acquire pairs with the release of the index in read/write */
+static unsigned gblfifo_len(struct gblfifo_dev *devp) {
+  unsigned tail = smp_load_acquire(&devp->tail);
+  return smp_load_acquire(&devp->head) - tail;
+}
+
 static int gblfifo_open(struct inode *inode, struct file *filp) {
   filp->private_data = container_of(inode->i_cdev, struct gblfifo_dev, cdev);
   return 0;
@@ -35,92 +45,90 @@ static int gblfifo_open(struct inode *inode, struct file *filp) {
 static ssize_t gblfifo_read(
     struct file *filp, char __user *buf, size_t len, loff_t *ppos) {
   int ret = 0;
+  size_t off, n;
+  bool was_full;
   struct gblfifo_dev *devp = filp->private_data;
-  DECLARE_WAITQUEUE(wait, current);
 
   mutex_lock(&devp->mutex);
 
-  add_wait_queue(&devp->r_wait, &wait);
-
-  while (devp->curl == 0) {
-    if (filp->f_flags & O_NONBLOCK) {
-      ret = -EAGAIN;
-      goto out;
-    }
-
+  while (gblfifo_len(devp) == 0) {
     mutex_unlock(&devp->mutex);
-    set_current_state(TASK_INTERRUPTIBLE);
-    schedule();
 
-    if (signal_pending(current)) {
-      remove_wait_queue(&devp->r_wait, &wait);
-      set_current_state(TASK_RUNNING);
+    if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+
+    /* exclusive, so a write wakes one reader instead of the whole herd */
+    if (wait_event_interruptible_exclusive(
+            devp->r_wait, READ_ONCE(devp->head) != READ_ONCE(devp->tail)))
       return -ERESTARTSYS;
-    }
+
     mutex_lock(&devp->mutex);
   }
 
-  if (len > devp->curl) len = devp->curl;
+  if (len > gblfifo_len(devp)) len = gblfifo_len(devp);
+  was_full = gblfifo_len(devp) == GBLFIFO_SIZE;
 
-  if (copy_to_user(buf, devp->mem, len)) {
+  /* the queued bytes may wrap around the end of mem */
+  off = devp->tail & GBLFIFO_MASK;
+  n = min_t(size_t, len, GBLFIFO_SIZE - off);
+  if (copy_to_user(buf, devp->mem + off, n) ||
+      copy_to_user(buf + n, devp->mem, len - n)) {
     ret = -EFAULT;
-    goto out;
   } else {
-    memcpy(devp->mem, devp->mem + len, devp->curl - len);
-    devp->curl -= len;
-    wake_up_interruptible(&devp->w_wait);
+    smp_store_release(&devp->tail, devp->tail + len);
+    pr_debug("read %zu bytes, %u queued\n", len, gblfifo_len(devp));
+    /* only the full -> non-full transition can unblock a writer */
+    if (was_full) wake_up_interruptible(&devp->w_wait);
+    /* pass the wakeup on if there is something left for another reader */
+    if (gblfifo_len(devp) != 0 && wq_has_sleeper(&devp->r_wait))
+      wake_up_interruptible(&devp->r_wait);
     ret = len;
   }
 
-out:
-  remove_wait_queue(&devp->r_wait, &wait);
   mutex_unlock(&devp->mutex);
-  set_current_state(TASK_RUNNING);
   return ret;
 }
 
 static ssize_t gblfifo_write(
     struct file *filp, const char __user *buf, size_t len, loff_t *ppos) {
   int ret = 0;
+  size_t off, n;
+  bool was_empty;
   struct gblfifo_dev *devp = filp->private_data;
 
-  DECLARE_WAITQUEUE(wait, current);
-
   mutex_lock(&devp->mutex);
-  add_wait_queue(&devp->w_wait, &wait);
-
-  while (devp->curl >= GBLFIFO_SIZE) {
-    if (filp->f_flags & O_NONBLOCK) {
-      ret = -EAGAIN;
-      goto out;
-    }
 
+  while (gblfifo_len(devp) >= GBLFIFO_SIZE) {
     mutex_unlock(&devp->mutex);
-    set_current_state(TASK_INTERRUPTIBLE);
-    schedule();
 
-    if (signal_pending(current)) {
-      remove_wait_queue(&devp->w_wait, &wait);
-      set_current_state(TASK_RUNNING);
+    if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+
+    if (wait_event_interruptible_exclusive(devp->w_wait,
+            READ_ONCE(devp->head) - READ_ONCE(devp->tail) < GBLFIFO_SIZE))
       return -ERESTARTSYS;
-    }
+
     mutex_lock(&devp->mutex);
   }
 
-  if (len >= GBLFIFO_SIZE - devp->curl) len = GBLFIFO_SIZE - devp->curl;
+  if (len >= GBLFIFO_SIZE - gblfifo_len(devp))
+    len = GBLFIFO_SIZE - gblfifo_len(devp);
+  was_empty = gblfifo_len(devp) == 0;
 
-  if (copy_from_user(devp->mem + devp->curl, buf, len)) {
+  off = devp->head & GBLFIFO_MASK;
+  n = min_t(size_t, len, GBLFIFO_SIZE - off);
+  if (copy_from_user(devp->mem + off, buf, n) ||
+      copy_from_user(devp->mem, buf + n, len - n)) {
     ret = -EFAULT;
   } else {
-    devp->curl += len;
-    wake_up_interruptible(&devp->r_wait);
+    smp_store_release(&devp->head, devp->head + len);
+    pr_debug("wrote %zu bytes, %u queued\n", len, gblfifo_len(devp));
+    /* only the empty -> non-empty transition can unblock a reader */
+    if (was_empty) wake_up_interruptible(&devp->r_wait);
+    if (gblfifo_len(devp) < GBLFIFO_SIZE && wq_has_sleeper(&devp->w_wait))
+      wake_up_interruptible(&devp->w_wait);
     ret = len;
   }
 
-out:
-  remove_wait_queue(&devp->w_wait, &wait);
   mutex_unlock(&devp->mutex);
-  set_current_state(TASK_RUNNING);
   return ret;
 }
 
@@ -134,27 +142,34 @@ static long gblfifo_ioctl(
   switch (cmd) {
   case FIFO_CLEAR:
     mutex_lock(&devp->mutex);
-    devp->curl = 0;
+    /* catch tail up rather than zero both, so poll never sees head < tail */
+    smp_store_release(&devp->tail, devp->head);
     mutex_unlock(&devp->mutex);
+    wake_up_interruptible(&devp->w_wait);
     break;
   default: return -EINVAL;
   }
   return 0;
 }
 
+/*
+ * Lockless: the waitqueue lock taken by poll_wait orders the index loads
+ * after our registration, and read/write wake the queues after moving an
+ * index, so a change we miss here still wakes us.
+ */
 static unsigned int gblfifo_poll(struct file *filp, poll_table *wait) {
   unsigned int mask = 0;
   struct gblfifo_dev *devp = filp->private_data;
+  unsigned len;
 
-  mutex_lock(&devp->mutex);
   poll_wait(filp, &devp->r_wait, wait);
   poll_wait(filp, &devp->w_wait, wait);
 
-  if (devp->curl != 0) { mask |= POLLIN | POLLRDNORM; }
+  len = gblfifo_len(devp);
+  if (len != 0) { mask |= POLLIN | POLLRDNORM; }
 
-  if (devp->curl != GBLFIFO_SIZE) { mask |= POLLOUT | POLLWRNORM; }
+  if (len != GBLFIFO_SIZE) { mask |= POLLOUT | POLLWRNORM; }
 
-  mutex_unlock(&devp->mutex);
   return mask;
 }
 
@@ -90,12 +90,12 @@ static long gblmem_ioctl(struct file *filp, unsigned int cmd,
   switch (cmd) {
   case BLKGETSIZE:
     err_code = copy_to_user((char __user *)arg, &size, sizeof(arg));
-    printk("copy_to_user: %p, %lu, %d", (char *)arg, size, err_code);
+    pr_debug("copy_to_user: %p, %lu, %d\n", (char *)arg, size, err_code);
     if (err_code < 0) return -EFAULT;
     return 0;
   case BLKGETSIZE64:
     err_code = copy_to_user((char __user *)arg, &size, sizeof(arg));
-    printk("copy_to_user: %p, %lu, %d", (char *)arg, size, err_code);
+    pr_debug("copy_to_user: %p, %lu, %d\n", (char *)arg, size, err_code);
     if (err_code < 0) return -EFAULT;
     return 0;
   default: return -EINVAL;
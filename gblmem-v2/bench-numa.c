@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gblmem.h"
+
+#define MAX_SAMPLES (1 << 20)
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* first number of a sysfs list like "0-3,8-11", -1 when it is empty */
+static int first_in_list(const char *path) {
+  FILE *f = fopen(path, "r");
+  int n = -1;
+
+  if (!f) return -1;
+  if (fscanf(f, "%d", &n) != 1) n = -1;
+  fclose(f);
+  return n;
+}
+
+/*
+ * pread size bytes at random offsets for ms milliseconds from a CPU of the
+ * given node, one CSV line with the latency percentiles and the bandwidth
+ */
+static void run(int fd, int node, size_t size, long ms, long long *lat) {
+  struct gblmem_replicas replicas;
+  off_t region = lseek(fd, 0, SEEK_END);
+  char path[64], *buf = malloc(size);
+  long long start, end, n = 0;
+  unsigned seed = node + 1;
+  cpu_set_t cpus;
+  int cpu;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+  cpu = first_in_list(path);
+  if (cpu < 0 || region < (off_t)size) goto out;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+    perror("sched_setaffinity");
+    goto out;
+  }
+  if (ioctl(fd, GBLMEM_GETREPLICAS, &replicas) < 0) {
+    perror("ioctl.GBLMEM_GETREPLICAS");
+    goto out;
+  }
+
+  start = now_ns();
+  end = start + ms * 1000000;
+  for (long long t = start; t < end && n < MAX_SAMPLES;) {
+    off_t off = (off_t)(rand_r(&seed) % (region / size)) * size;
+    if (pread(fd, buf, size, off) < 0) {
+      perror("pread");
+      goto out;
+    }
+    lat[n] = now_ns() - t;
+    t += lat[n++];
+  }
+  qsort(lat, n, sizeof(*lat), cmp_ll);
+
+  printf("%d,%d,%u,%zu,%lld,%lld,%.2f\n", node, replicas.node,
+         replicas.nr_copies, size, lat[n / 2], lat[(long)(0.99 * (n - 1))],
+         (double)n * size * 1e3 / (now_ns() - start));
+  fflush(stdout);
+
+out:
+  free(buf);
+}
+
+int main(int argc, const char *argv[]) {
+  static const size_t sizes[] = {4096, 65536, 1 << 20};
+  long long *lat = malloc(sizeof(*lat) * MAX_SAMPLES);
+  int nodes;
+
+  if (argc < 2) {
+    printf("need gblmem cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  /* node ids run up to the last number of the online list, gaps are skipped */
+  FILE *f = fopen("/sys/devices/system/node/online", "r");
+  char online[256] = "0", *last = online;
+  if (f) {
+    if (!fgets(online, sizeof(online), f)) strcpy(online, "0");
+    fclose(f);
+  }
+  for (char *p = online; *p; p++)
+    if (*p == '-' || *p == ',') last = p + 1;
+  nodes = atoi(last) + 1;
+
+  printf("cpu_node,copy_node,copies,size,p50_ns,p99_ns,mb_per_sec\n");
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    for (int node = 0; node < nodes; node++)
+      run(fd, node, sizes[s], 1000, lat);
+
+  close(fd);
+  free(lat);
+  return 0;
+}
@@ -1,23 +1,379 @@
+#include <linux/bitmap.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/huge_mm.h>
 #include <linux/init.h>
 #include <linux/major.h>
+#include <linux/mman.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/nodemask.h>
+#include <linux/pfn_t.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/slab.h>
+#include <linux/splice.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/vmalloc.h>
 
+#include "gblmem.h"
+#include "gblmem_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "gblmem_trace.h"
+
 #define GBLMEM_MAJOR 230
 #define GBLMEM_SIZE 1024
+#define GBLMEM_HUGE_ORDER (PMD_SHIFT - PAGE_SHIFT)
+#define GBLMEM_SNAP_CHUNK (1UL << 20)
+
+static unsigned long gblmem_size = GBLMEM_SIZE;
+module_param_named(size, gblmem_size, ulong, 0444);
+MODULE_PARM_DESC(size, "size of the global memory in bytes");
+
+static bool huge = true;
+module_param(huge, bool, 0444);
+MODULE_PARM_DESC(huge, "back regions >= PMD size with PMD-sized pages");
+
+static char *snapshot;
+module_param(snapshot, charp, 0444);
+MODULE_PARM_DESC(snapshot, "file restored at load and dumped at unload");
+
+static bool lazy_restore;
+module_param(lazy_restore, bool, 0444);
+MODULE_PARM_DESC(lazy_restore, "restore snapshot chunks on first access");
+
+static bool replicate;
+module_param(replicate, bool, 0444);
+MODULE_PARM_DESC(replicate, "keep a copy of the region on every memory node");
+
+/* the region's bytes on one node */
+struct gblmem_copy {
+  uint8_t *mem;
+  /* PMD-sized pages behind mem, NULL when mem is a plain vmalloc area */
+  struct page **chunks;
+  unsigned long nr_chunks;
+};
 
 struct gblmem_dev {
   struct cdev cdev;
   struct mutex mutex;
-  uint8_t mem[GBLMEM_SIZE];
+  size_t size;
+  /* written first, the only copy read back by dumps */
+  struct gblmem_copy home;
+  int home_nid; /* NUMA_NO_NODE without replicate */
+  /*
+   * With replicate, the copy each node reads, by node id: home for its own
+   * node and for nodes that could not get one laid out like home.
+   */
+  struct gblmem_copy **copies;
+  atomic64_t pmd_faults;
+  atomic64_t pte_faults;
+  /* snapshot being restored lazily, NULL once every chunk is in memory */
+  struct file *snap;
+  struct mutex restore_lock;
+  unsigned long *restored;
+  unsigned long nr_pending;
 };
 
 static struct gblmem_dev *gblmem_devp = NULL;
 
+static size_t gblmem_map_size(struct gblmem_dev *devp) {
+  if (devp->home.chunks) return devp->home.nr_chunks << PMD_SHIFT;
+  return PAGE_ALIGN(devp->size);
+}
+
+/*
+ * The copy to read from on this CPU's node. Any copy is as good as another
+ * under mutex, so it doesn't matter if the caller migrates.
+ */
+static struct gblmem_copy *gblmem_local(struct gblmem_dev *devp) {
+  if (!devp->copies) return &devp->home;
+  return devp->copies[numa_node_id()];
+}
+
+static unsigned long gblmem_pfn(struct gblmem_copy *c, size_t off) {
+  if (c->chunks)
+    return page_to_pfn(c->chunks[off >> PMD_SHIFT]) +
+           ((off & ~PMD_MASK) >> PAGE_SHIFT);
+  return vmalloc_to_pfn(c->mem + off);
+}
+
+static void gblmem_free_chunks(struct gblmem_copy *c) {
+  unsigned long i;
+  for (i = 0; i < c->nr_chunks; i++) {
+    if (c->chunks[i]) __free_pages(c->chunks[i], GBLMEM_HUGE_ORDER);
+  }
+  kfree(c->chunks);
+  c->chunks = NULL;
+  c->nr_chunks = 0;
+}
+
+/* allocate PMD-sized pages and vmap them so read/write see a flat buffer */
+static int gblmem_alloc_huge(struct gblmem_copy *c, size_t size, int nid) {
+  unsigned long i, j, nr_pages;
+  struct page **pages;
+
+  c->nr_chunks = DIV_ROUND_UP(size, PMD_SIZE);
+  c->chunks = kcalloc(c->nr_chunks, sizeof(struct page *), GFP_KERNEL);
+  if (!c->chunks) return -ENOMEM;
+
+  nr_pages = c->nr_chunks << GBLMEM_HUGE_ORDER;
+  pages = kvmalloc_array(nr_pages, sizeof(struct page *), GFP_KERNEL);
+  if (!pages) goto error;
+
+  for (i = 0; i < c->nr_chunks; i++) {
+    c->chunks[i] = alloc_pages_node(nid,
+        GFP_KERNEL | __GFP_ZERO | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY |
+            (nid == NUMA_NO_NODE ? 0 : __GFP_THISNODE),
+        GBLMEM_HUGE_ORDER);
+    if (!c->chunks[i]) goto error;
+    for (j = 0; j < (1UL << GBLMEM_HUGE_ORDER); j++)
+      pages[(i << GBLMEM_HUGE_ORDER) + j] = c->chunks[i] + j;
+  }
+
+  c->mem = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+  if (!c->mem) goto error;
+
+  kvfree(pages);
+  return 0;
+
+error:
+  kvfree(pages);
+  gblmem_free_chunks(c);
+  return -ENOMEM;
+}
+
+static void gblmem_free_copy(struct gblmem_copy *c) {
+  if (c->chunks) {
+    vunmap(c->mem);
+    gblmem_free_chunks(c);
+  } else {
+    vfree(c->mem);
+  }
+  c->mem = NULL;
+}
+
+/*
+ * A copy on every other node with memory, laid out like home so a mapping
+ * can be served from any of them. A node that can't get one reads home.
+ */
+static int gblmem_alloc_copies(struct gblmem_dev *devp, int home) {
+  struct gblmem_copy *c;
+  int nid;
+
+  devp->copies = kcalloc(nr_node_ids, sizeof(*devp->copies), GFP_KERNEL);
+  if (!devp->copies) return -ENOMEM;
+
+  for_each_node(nid) {
+    devp->copies[nid] = &devp->home;
+    if (nid == home || !node_state(nid, N_MEMORY)) continue;
+
+    c = kzalloc_node(sizeof(*c), GFP_KERNEL, nid);
+    if (!c) continue;
+    if (devp->home.chunks)
+      gblmem_alloc_huge(c, devp->size, nid);
+    else
+      c->mem = vzalloc_node(PAGE_ALIGN(devp->size), nid);
+    if (!c->mem) {
+      printk(KERN_WARNING "gblmem: no copy on node %d, it reads node %d\n",
+          nid, home);
+      kfree(c);
+      continue;
+    }
+    devp->copies[nid] = c;
+  }
+  return 0;
+}
+
+static void gblmem_free_copies(struct gblmem_dev *devp) {
+  int nid;
+
+  if (!devp->copies) return;
+  for_each_node(nid) {
+    if (devp->copies[nid] == &devp->home) continue;
+    gblmem_free_copy(devp->copies[nid]);
+    kfree(devp->copies[nid]);
+  }
+  kfree(devp->copies);
+  devp->copies = NULL;
+}
+
+/* pass [pos, pos + len) of home on to the other copies */
+static void gblmem_propagate(struct gblmem_dev *devp, size_t pos, size_t len) {
+  int nid;
+
+  if (!devp->copies) return;
+  for_each_node(nid) {
+    if (devp->copies[nid] != &devp->home)
+      memcpy(devp->copies[nid]->mem + pos, devp->home.mem + pos, len);
+  }
+}
+
+static int gblmem_alloc(struct gblmem_dev *devp) {
+  /* with copies elsewhere, home belongs on the node it is known to be on */
+  int nid = replicate ? numa_node_id() : NUMA_NO_NODE;
+  struct gblmem_copy *c = &devp->home;
+
+  devp->home_nid = nid;
+  if (huge && devp->size >= PMD_SIZE &&
+      gblmem_alloc_huge(c, devp->size, nid) == 0)
+    goto out;
+
+  c->mem = replicate ? vzalloc_node(PAGE_ALIGN(devp->size), nid)
+                     : vmalloc_user(PAGE_ALIGN(devp->size));
+  if (!c->mem) return -ENOMEM;
+
+out:
+  if (replicate && gblmem_alloc_copies(devp, nid)) {
+    gblmem_free_copy(c);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+static void gblmem_free(struct gblmem_dev *devp) {
+  if (devp->snap) filp_close(devp->snap, NULL);
+  devp->snap = NULL;
+  bitmap_free(devp->restored);
+  devp->restored = NULL;
+
+  gblmem_free_copies(devp);
+  gblmem_free_copy(&devp->home);
+}
+
+static unsigned long gblmem_nr_snap_chunks(struct gblmem_dev *devp) {
+  return DIV_ROUND_UP(devp->size, GBLMEM_SNAP_CHUNK);
+}
+
+/* first chunk at or after i holding data, so holes are never read back */
+static unsigned long gblmem_next_data_chunk(
+    struct gblmem_dev *devp, struct file *f, unsigned long i) {
+  loff_t data = vfs_llseek(f, (loff_t)i * GBLMEM_SNAP_CHUNK, SEEK_DATA);
+  if (data < 0 || data >= devp->size) return gblmem_nr_snap_chunks(devp);
+  return data / GBLMEM_SNAP_CHUNK;
+}
+
+static int gblmem_load_chunk(
+    struct gblmem_dev *devp, struct file *f, unsigned long i) {
+  loff_t pos = (loff_t)i * GBLMEM_SNAP_CHUNK, start = pos;
+  size_t len = min_t(size_t, GBLMEM_SNAP_CHUNK, devp->size - pos);
+
+  while (len) {
+    ssize_t n = kernel_read(f, devp->home.mem + pos, len, &pos);
+    if (n < 0) return n;
+    if (n == 0) break; /* short file, the rest stays zero */
+    len -= n;
+  }
+  /* nobody reads the chunk before it is marked restored */
+  gblmem_propagate(devp, start, pos - start);
+  return 0;
+}
+
+/* make sure [pos, pos + len) has been read back from a lazy snapshot */
+static int gblmem_restore_range(
+    struct gblmem_dev *devp, loff_t pos, size_t len) {
+  unsigned long i, last;
+  int ret = 0;
+
+  if (!READ_ONCE(devp->snap) || pos >= devp->size || len == 0) return 0;
+  if (len > devp->size - pos) len = devp->size - pos;
+
+  last = (pos + len - 1) / GBLMEM_SNAP_CHUNK;
+  for (i = pos / GBLMEM_SNAP_CHUNK; i <= last && !ret; i++) {
+    if (test_bit(i, devp->restored)) continue;
+
+    mutex_lock(&devp->restore_lock);
+    if (!test_bit(i, devp->restored)) {
+      ret = gblmem_load_chunk(devp, devp->snap, i);
+      if (ret == 0) {
+        smp_mb__before_atomic();
+        set_bit(i, devp->restored);
+        if (--devp->nr_pending == 0) {
+          filp_close(devp->snap, NULL);
+          WRITE_ONCE(devp->snap, NULL);
+        }
+      }
+    }
+    mutex_unlock(&devp->restore_lock);
+  }
+  smp_rmb();
+
+  return ret;
+}
+
+static int gblmem_restore(struct gblmem_dev *devp, const char *path) {
+  unsigned long i, next, nr = gblmem_nr_snap_chunks(devp);
+  struct file *f;
+  int ret = 0;
+
+  f = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+  if (IS_ERR(f)) return PTR_ERR(f) == -ENOENT ? 0 : PTR_ERR(f);
+
+  devp->restored = bitmap_zalloc(nr, GFP_KERNEL);
+  if (!devp->restored) {
+    filp_close(f, NULL);
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < nr; i = next + 1) {
+    next = gblmem_next_data_chunk(devp, f, i);
+    bitmap_set(devp->restored, i, next - i);
+    if (next >= nr) break;
+    if (lazy_restore) {
+      devp->nr_pending++;
+      continue;
+    }
+    ret = gblmem_load_chunk(devp, f, next);
+    if (ret) break;
+    set_bit(next, devp->restored);
+  }
+
+  if (devp->nr_pending && !ret)
+    devp->snap = f;
+  else
+    filp_close(f, NULL);
+  return ret;
+}
+
+/* all-zero chunks are left as holes so restore time tracks the data used */
+static int gblmem_dump(struct gblmem_dev *devp, const char *path) {
+  struct file *f;
+  loff_t pos = 0;
+  int ret;
+
+  ret = gblmem_restore_range(devp, 0, devp->size);
+  if (ret) return ret;
+
+  f = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+  if (IS_ERR(f)) return PTR_ERR(f);
+
+  mutex_lock(&devp->mutex);
+  while (pos < devp->size && !ret) {
+    size_t len = min_t(size_t, GBLMEM_SNAP_CHUNK, devp->size - pos);
+
+    if (!memchr_inv(devp->home.mem + pos, 0, len)) {
+      pos += len;
+      continue;
+    }
+    while (len) {
+      ssize_t n = kernel_write(f, devp->home.mem + pos, len, &pos);
+      if (n <= 0) {
+        ret = n ? n : -EIO;
+        break;
+      }
+      len -= n;
+    }
+  }
+  mutex_unlock(&devp->mutex);
+
+  if (!ret) ret = vfs_truncate(&f->f_path, devp->size);
+  if (!ret) ret = vfs_fsync(f, 0);
+  filp_close(f, NULL);
+  return ret;
+}
+
 static int gblmem_open(struct inode *inode, struct file *filp) {
   filp->private_data = container_of(inode->i_cdev, struct gblmem_dev, cdev);
   return 0;
@@ -29,13 +385,15 @@ static ssize_t gblmem_read(
   struct gblmem_dev *devp = filp->private_data;
   loff_t pos = *ppos;
   if (pos < 0) return -EINVAL;
-  if (pos >= GBLMEM_SIZE) return 0;
+  len = gblmem_clamp(pos, len, devp->size);
+  if (!len) return 0;
 
-  /* avoid ops + len overflow */
-  if (len >= GBLMEM_SIZE - pos) len = GBLMEM_SIZE - pos;
+  ret = gblmem_restore_range(devp, pos, len);
+  if (ret) return ret;
 
+  trace_gblmem_read(pos, len);
   mutex_lock(&devp->mutex);
-  ret = copy_to_user(buf, devp->mem + pos, len);
+  ret = copy_to_user(buf, gblmem_local(devp)->mem + pos, len);
   if (ret >= 0) {
     *ppos += len;
     ret = len;
@@ -51,12 +409,16 @@ static ssize_t gblmem_write(
   struct gblmem_dev *devp = filp->private_data;
   loff_t pos = *ppos;
   if (pos < 0) return -EINVAL;
-  if (pos >= GBLMEM_SIZE) return 0;
+  len = gblmem_clamp(pos, len, devp->size);
+  if (!len) return 0;
 
-  if (len >= GBLMEM_SIZE - pos) len = GBLMEM_SIZE - pos;
+  ret = gblmem_restore_range(devp, pos, len);
+  if (ret) return ret;
 
+  trace_gblmem_write(pos, len);
   mutex_lock(&devp->mutex);
-  ret = copy_from_user(devp->mem + pos, buf, len);
+  ret = copy_from_user(devp->home.mem + pos, buf, len);
+  gblmem_propagate(devp, pos, len);
   if (ret >= 0) {
     *ppos += len;
     ret = len;
@@ -67,52 +429,274 @@ static ssize_t gblmem_write(
 }
 
 static loff_t gblmem_llseek(struct file *filp, loff_t offset, int orig) {
-  loff_t ret = 0;
+  loff_t ret;
   struct gblmem_dev *devp = filp->private_data;
 
   mutex_lock(&devp->mutex);
-  switch (orig) {
-  case SEEK_SET:
-    if (offset < 0)
-      ret = -EINVAL;
-    else if (offset > GBLMEM_SIZE)
-      ret = -EINVAL;
-    else {
-      filp->f_pos = (unsigned int)offset;
-    }
-    break;
-  case SEEK_CUR:
-    if ((filp->f_pos + offset) > GBLMEM_SIZE)
-      ret = -EINVAL;
-    else if ((filp->f_pos + offset) < 0)
-      ret = -EINVAL;
-    else
-      filp->f_pos += offset;
-    break;
-  case SEEK_END: filp->f_pos = GBLMEM_SIZE; break;
-  default: ret = -EINVAL; break;
+  ret = gblmem_seek_pos(filp->f_pos, offset, orig, devp->size);
+  if (ret >= 0) filp->f_pos = ret;
+  mutex_unlock(&devp->mutex);
+
+  return ret;
+}
+
+/*
+ * splice_read hands out references to the pages backing the region instead
+ * of copying them, like vmsplice: a later write to the same range is visible
+ * to whoever has not consumed the pipe buffer yet.
+ */
+static int gblmem_pipe_buf_steal(
+    struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+  return 1;
+}
+
+static const struct pipe_buf_operations gblmem_pipe_buf_ops = {
+    .confirm = generic_pipe_buf_confirm,
+    .release = generic_pipe_buf_release,
+    .steal = gblmem_pipe_buf_steal,
+    .get = generic_pipe_buf_get,
+};
+
+static void gblmem_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+  put_page(spd->pages[i]);
+}
+
+static ssize_t gblmem_splice_read(struct file *filp, loff_t *ppos,
+    struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+  struct gblmem_dev *devp = filp->private_data;
+  struct page *pages[PIPE_DEF_BUFFERS];
+  struct partial_page partial[PIPE_DEF_BUFFERS];
+  struct splice_pipe_desc spd = {
+      .pages = pages,
+      .partial = partial,
+      .nr_pages_max = PIPE_DEF_BUFFERS,
+      .ops = &gblmem_pipe_buf_ops,
+      .spd_release = gblmem_spd_release,
+  };
+  loff_t pos = *ppos;
+  ssize_t ret;
+
+  if (pos < 0) return -EINVAL;
+  len = gblmem_clamp(pos, len, devp->size);
+  if (!len) return 0;
+
+  ret = gblmem_restore_range(devp, pos, len);
+  if (ret) return ret;
+
+  while (len && spd.nr_pages < spd.nr_pages_max) {
+    size_t off = offset_in_page(pos);
+    size_t n = min_t(size_t, len, PAGE_SIZE - off);
+    struct page *page =
+        pfn_to_page(gblmem_pfn(gblmem_local(devp), pos - off));
+
+    get_page(page);
+    pages[spd.nr_pages] = page;
+    partial[spd.nr_pages].offset = off;
+    partial[spd.nr_pages].len = n;
+    spd.nr_pages++;
+    pos += n;
+    len -= n;
   }
-  ret = filp->f_pos;
+
+  ret = splice_to_pipe(pipe, &spd);
+  if (ret > 0) *ppos += ret;
+  return ret;
+}
+
+static int gblmem_pipe_to_mem(struct pipe_inode_info *pipe,
+    struct pipe_buffer *buf, struct splice_desc *sd) {
+  struct gblmem_dev *devp = sd->u.file->private_data;
+  size_t len = sd->len;
+  char *src;
+  int ret;
+
+  len = gblmem_clamp(sd->pos, len, devp->size);
+  if (!len) return 0;
+
+  ret = pipe_buf_confirm(pipe, buf);
+  if (ret) return ret;
+
+  ret = gblmem_restore_range(devp, sd->pos, len);
+  if (ret) return ret;
+
+  mutex_lock(&devp->mutex);
+  src = kmap_atomic(buf->page);
+  memcpy(devp->home.mem + sd->pos, src + buf->offset, len);
+  kunmap_atomic(src);
+  gblmem_propagate(devp, sd->pos, len);
   mutex_unlock(&devp->mutex);
 
+  return len;
+}
+
+static ssize_t gblmem_splice_write(struct pipe_inode_info *pipe,
+    struct file *filp, loff_t *ppos, size_t len, unsigned int flags) {
+  ssize_t ret;
+
+  if (*ppos < 0) return -EINVAL;
+
+  ret = splice_from_pipe(pipe, filp, ppos, len, flags, gblmem_pipe_to_mem);
+  if (ret > 0) *ppos += ret;
   return ret;
 }
 
+static vm_fault_t gblmem_vm_fault(struct vm_fault *vmf) {
+  struct gblmem_dev *devp = vmf->vma->vm_private_data;
+  size_t off = vmf->pgoff << PAGE_SHIFT;
+
+  if (off >= gblmem_map_size(devp)) return VM_FAULT_SIGBUS;
+  if (gblmem_restore_range(devp, off, PAGE_SIZE)) return VM_FAULT_SIGBUS;
+
+  atomic64_inc(&devp->pte_faults);
+  trace_gblmem_fault(off, false);
+  return vmf_insert_pfn(
+      vmf->vma, vmf->address, gblmem_pfn(gblmem_local(devp), off));
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Only reached when THP is enabled for the vma (always, or madvise with the
+ * VM_HUGEPAGE we set in mmap). Anything that can't be covered by one whole
+ * chunk falls back to gblmem_vm_fault.
+ */
+static vm_fault_t gblmem_huge_fault(
+    struct vm_fault *vmf, enum page_entry_size pe_size) {
+  struct vm_area_struct *vma = vmf->vma;
+  struct gblmem_dev *devp = vma->vm_private_data;
+  struct gblmem_copy *c = gblmem_local(devp);
+  unsigned long haddr = vmf->address & PMD_MASK;
+  size_t off;
+  vm_fault_t ret;
+
+  if (pe_size != PE_SIZE_PMD || !c->chunks) return VM_FAULT_FALLBACK;
+  if (haddr < vma->vm_start || haddr + PMD_SIZE > vma->vm_end)
+    return VM_FAULT_FALLBACK;
+
+  off = ((haddr - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+  off <<= PAGE_SHIFT;
+  if (off & ~PMD_MASK) return VM_FAULT_FALLBACK;
+  if (off >= gblmem_map_size(devp)) return VM_FAULT_SIGBUS;
+  if (gblmem_restore_range(devp, off, PMD_SIZE)) return VM_FAULT_SIGBUS;
+
+  ret = vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(gblmem_pfn(c, off)),
+      vmf->flags & FAULT_FLAG_WRITE);
+  if (ret == VM_FAULT_NOPAGE) {
+    atomic64_inc(&devp->pmd_faults);
+    trace_gblmem_fault(off, true);
+  }
+  return ret;
+}
+#endif
+
+static const struct vm_operations_struct gblmem_vm_ops = {
+    .fault = gblmem_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = gblmem_huge_fault,
+#endif
+};
+
+static int gblmem_mmap(struct file *filp, struct vm_area_struct *vma) {
+  struct gblmem_dev *devp = filp->private_data;
+  size_t len = vma->vm_end - vma->vm_start;
+  size_t off = vma->vm_pgoff << PAGE_SHIFT;
+
+  if (!(vma->vm_flags & VM_SHARED)) return -EINVAL;
+  if (off >= gblmem_map_size(devp) || len > gblmem_map_size(devp) - off)
+    return -EINVAL;
+  /* stores through a mapping of one copy would never reach the others */
+  if (devp->copies) {
+    if (vma->vm_flags & VM_WRITE) return -EACCES;
+    vma->vm_flags &= ~VM_MAYWRITE;
+  }
+
+  vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+  if (devp->home.chunks) vma->vm_flags |= VM_HUGEPAGE;
+  vma->vm_ops = &gblmem_vm_ops;
+  vma->vm_private_data = devp;
+  return 0;
+}
+
+/*
+ * thp_get_unmapped_area only aligns DAX files. Do the same for us: search
+ * for len plus a PMD, then start where the address and the file offset sit
+ * at the same place in a PMD, so whole chunks line up with PMDs.
+ */
+static unsigned long gblmem_get_unmapped_area(struct file *filp,
+    unsigned long addr, unsigned long len, unsigned long pgoff,
+    unsigned long flags) {
+  struct gblmem_dev *devp = filp->private_data;
+  unsigned long off = pgoff << PAGE_SHIFT, len_pad, ret;
+
+  if (!IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE) || !devp->home.chunks ||
+      addr || (flags & MAP_FIXED) || len < PMD_SIZE)
+    goto out;
+
+  len_pad = len + PMD_SIZE;
+  if (len_pad < len) goto out;
+  ret = current->mm->get_unmapped_area(filp, 0, len_pad, pgoff, flags);
+  if (IS_ERR_VALUE(ret)) goto out;
+  return ret + ((off - ret) & (PMD_SIZE - 1));
+
+out:
+  return current->mm->get_unmapped_area(filp, addr, len, pgoff, flags);
+}
+
+static long gblmem_get_replicas(
+    struct gblmem_dev *devp, struct gblmem_replicas __user *ureplicas) {
+  struct gblmem_replicas replicas = {.nr_copies = 1, .node = NUMA_NO_NODE};
+  int nid;
+
+  if (devp->copies) {
+    for_each_node(nid) {
+      if (devp->copies[nid] != &devp->home) replicas.nr_copies++;
+    }
+    nid = numa_node_id();
+    replicas.node = devp->copies[nid] == &devp->home ? devp->home_nid : nid;
+  }
+  return copy_to_user(ureplicas, &replicas, sizeof(replicas)) ? -EFAULT : 0;
+}
+
 static long gblmem_ioctl(
     struct file *filp, unsigned int cmd, unsigned long arg) {
   int err_code = 0;
-  unsigned long size = GBLMEM_SIZE;
+  struct gblmem_dev *devp = filp->private_data;
+  unsigned long size = devp->size;
+  struct gblmem_mapinfo info;
+  char *path;
   switch (cmd) {
   case BLKGETSIZE:
     err_code = copy_to_user((char __user *)arg, &size, sizeof(arg));
-    printk("copy_to_user: %p, %lu, %d", (char *)arg, size, err_code);
+    pr_debug("copy_to_user: %p, %lu, %d\n", (char *)arg, size, err_code);
     if (err_code < 0) return -EFAULT;
     return 0;
   case BLKGETSIZE64:
     err_code = copy_to_user((char __user *)arg, &size, sizeof(arg));
-    printk("copy_to_user: %p, %lu, %d", (char *)arg, size, err_code);
+    pr_debug("copy_to_user: %p, %lu, %d\n", (char *)arg, size, err_code);
     if (err_code < 0) return -EFAULT;
     return 0;
+  case GBLMEM_GETMAPINFO:
+    memset(&info, 0, sizeof(info));
+    info.size = devp->size;
+    info.map_size = gblmem_map_size(devp);
+    info.chunk_size = devp->home.chunks ? PMD_SIZE : PAGE_SIZE;
+    info.nr_chunks = info.map_size / info.chunk_size;
+    info.pmd_faults = atomic64_read(&devp->pmd_faults);
+    info.pte_faults = atomic64_read(&devp->pte_faults);
+    if (copy_to_user((void __user *)arg, &info, sizeof(info))) return -EFAULT;
+    return 0;
+  case GBLMEM_GETREPLICAS:
+    return gblmem_get_replicas(devp, (struct gblmem_replicas __user *)arg);
+  case GBLMEM_SNAPSHOT:
+    if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+    if (!arg) {
+      if (!snapshot) return -EINVAL;
+      return gblmem_dump(devp, snapshot);
+    }
+    path = strndup_user((const char __user *)arg, PATH_MAX);
+    if (IS_ERR(path)) return PTR_ERR(path);
+    err_code = gblmem_dump(devp, path);
+    kfree(path);
+    return err_code;
   default: return -EINVAL;
   }
 }
@@ -123,6 +707,10 @@ static const struct file_operations gblmem_ops = {
     .read = gblmem_read,
     .write = gblmem_write,
     .llseek = gblmem_llseek,
+    .splice_read = gblmem_splice_read,
+    .splice_write = gblmem_splice_write,
+    .mmap = gblmem_mmap,
+    .get_unmapped_area = gblmem_get_unmapped_area,
     .unlocked_ioctl = gblmem_ioctl,
 #if 0
   .ioctl = xx,
@@ -136,6 +724,23 @@ static int __init gblmem_init(void) {
 
   if (!gblmem_devp) goto error_malloc;
 
+  mutex_init(&gblmem_devp->mutex);
+  mutex_init(&gblmem_devp->restore_lock);
+
+  gblmem_devp->size = gblmem_size;
+  if (gblmem_alloc(gblmem_devp)) goto error_alloc_mem;
+
+  printk(KERN_INFO "gblmem: %zu bytes backed by %s pages\n", gblmem_devp->size,
+      gblmem_devp->home.chunks ? "PMD-sized" : "small");
+
+  if (snapshot) {
+    err_code = gblmem_restore(gblmem_devp, snapshot);
+    if (err_code < 0) {
+      printk("Fail to restore snapshot %s: %d\n", snapshot, err_code);
+      goto error_register_region;
+    }
+  }
+
   err_code = register_chrdev_region(dev, 1, "gblmem");
   if (err_code < 0) goto error_register_region;
 
@@ -144,24 +749,34 @@ static int __init gblmem_init(void) {
   err_code = cdev_add(&gblmem_devp->cdev, dev, 1);
   if (err_code < 0) goto error_cdev_add;
 
-  mutex_init(&gblmem_devp->mutex);
-
   return 0;
 
 error_cdev_add:
   printk("Fail to invoke cdev_add\n");
+  unregister_chrdev_region(dev, 1);
 
 error_register_region:
+  gblmem_free(gblmem_devp);
   vfree(gblmem_devp);
   return err_code;
 
+error_alloc_mem:
+  vfree(gblmem_devp);
+
 error_malloc:
   return -ENOMEM;
 }
 
 static void __exit gblmem_exit(void) {
+  int err_code;
   if (gblmem_devp) {
     cdev_del(&gblmem_devp->cdev);
+    if (snapshot) {
+      err_code = gblmem_dump(gblmem_devp, snapshot);
+      if (err_code < 0)
+        printk("Fail to dump snapshot %s: %d\n", snapshot, err_code);
+    }
+    gblmem_free(gblmem_devp);
     vfree(gblmem_devp);
   }
   unregister_chrdev_region(MKDEV(GBLMEM_MAJOR, 0), 1);
@@ -0,0 +1,44 @@
+#ifndef GBLMEM_H
+#define GBLMEM_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define GBLMEM_IOC_MAGIC 'g'
+
+/* granularity actually obtained for the backing store and user mappings */
+struct gblmem_mapinfo {
+  __u64 size;       /* bytes visible through read/write */
+  __u64 map_size;   /* bytes that can be mmap'ed */
+  __u32 chunk_size; /* PMD size if huge-backed, else PAGE_SIZE */
+  __u32 nr_chunks;
+  __u64 pmd_faults; /* faults served with a huge PMD entry */
+  __u64 pte_faults; /* faults served with a 4 KiB PTE */
+};
+
+#define GBLMEM_GETMAPINFO _IOR(GBLMEM_IOC_MAGIC, 1, struct gblmem_mapinfo)
+
+/*
+ * dump the region to the file named by the (char *) argument, or to the
+ * snapshot module parameter when the argument is 0
+ */
+#define GBLMEM_SNAPSHOT _IO(GBLMEM_IOC_MAGIC, 2)
+
+/*
+ * With the replicate module parameter every memory node keeps a copy of
+ * the region, and read(), splice_read and mappings use the one on the
+ * caller's node. write() and splice_write update the copies one after
+ * another before returning, under the lock read() takes, so a read() on
+ * any node sees a write either whole or not at all. A mapping reads the
+ * copy of the node its pages were first touched from, and may see a write
+ * in pieces, or on one node before another, until write() has returned.
+ * Mappings are read-only in this mode.
+ */
+struct gblmem_replicas {
+  __u32 nr_copies; /* 1 without replicate */
+  __s32 node;      /* whose copy a read() from here uses, -1 without it */
+};
+
+#define GBLMEM_GETREPLICAS _IOR(GBLMEM_IOC_MAGIC, 3, struct gblmem_replicas)
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef GBLMEM_CORE_H
+#define GBLMEM_CORE_H
+
+/*
+ * Bounds and seek arithmetic shared by the driver and kunit/gblmem_test.c.
+ * Nothing in here touches a gblmem_dev, so the tests can run it on UML.
+ */
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/overflow.h>
+
+/* how much of a len byte access at pos lands inside a size byte region */
+static inline size_t gblmem_clamp(loff_t pos, size_t len, size_t size) {
+  if (pos < 0 || pos >= size) return 0;
+  return min_t(size_t, len, size - pos);
+}
+
+/* the position llseek moves to, -EINVAL if it is outside [0, size] */
+static inline loff_t gblmem_seek_pos(
+    loff_t pos, loff_t offset, int whence, size_t size) {
+  loff_t base;
+
+  switch (whence) {
+  case SEEK_SET: base = 0; break;
+  case SEEK_CUR: base = pos; break;
+  case SEEK_END: base = size; break;
+  default: return -EINVAL;
+  }
+  if (check_add_overflow(base, offset, &pos)) return -EINVAL;
+  if (pos < 0 || pos > size) return -EINVAL;
+  return pos;
+}
+
+#endif
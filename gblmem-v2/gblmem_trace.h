@@ -0,0 +1,56 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gblmem
+
+#if !defined(_GBLMEM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GBLMEM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(gblmem_access,
+  TP_PROTO(loff_t pos, size_t len),
+  TP_ARGS(pos, len),
+  TP_STRUCT__entry(
+    __field(loff_t, pos)
+    __field(size_t, len)
+  ),
+  TP_fast_assign(
+    __entry->pos = pos;
+    __entry->len = len;
+  ),
+  TP_printk("pos=%lld len=%zu", __entry->pos, __entry->len)
+);
+
+/* len is what is left after clamping to the region */
+DEFINE_EVENT(gblmem_access, gblmem_read,
+  TP_PROTO(loff_t pos, size_t len),
+  TP_ARGS(pos, len)
+);
+
+DEFINE_EVENT(gblmem_access, gblmem_write,
+  TP_PROTO(loff_t pos, size_t len),
+  TP_ARGS(pos, len)
+);
+
+/* a page or PMD mapped into a process by the fault handlers */
+TRACE_EVENT(gblmem_fault,
+  TP_PROTO(size_t off, bool pmd),
+  TP_ARGS(off, pmd),
+  TP_STRUCT__entry(
+    __field(size_t, off)
+    __field(bool, pmd)
+  ),
+  TP_fast_assign(
+    __entry->off = off;
+    __entry->pmd = pmd;
+  ),
+  TP_printk("off=%#zx %s", __entry->off, __entry->pmd ? "pmd" : "pte")
+);
+
+#endif
+
+/* the module is built out of tree, see CFLAGS_gblmem.o in the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gblmem_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,52 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gblmem.h"
+
+int main(int argc, const char *argv[]) {
+  struct gblmem_mapinfo info;
+
+  if (argc < 2) {
+    printf("need gblmem cdev file\n");
+    return 0;
+  }
+
+  int fd = open(argv[1], O_RDWR);
+  if (fd < 0) {
+    perror("open");
+    return 0;
+  }
+
+  if (ioctl(fd, GBLMEM_GETMAPINFO, &info) < 0) {
+    perror("ioctl.GBLMEM_GETMAPINFO");
+    return 0;
+  }
+
+  char *p = mmap(NULL, info.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return 0;
+  }
+  /* huge faults need the mapping to start on a chunk boundary */
+  printf("mapped at %p, %saligned to a chunk\n", p,
+      (uintptr_t)p % info.chunk_size ? "not " : "");
+
+  /* touch every page so each chunk gets faulted in */
+  for (unsigned long off = 0; off < info.map_size; off += 4096) p[off]++;
+
+  ioctl(fd, GBLMEM_GETMAPINFO, &info);
+  printf("size %llu, mapped %llu bytes in %u chunks of %u bytes\n",
+      (unsigned long long)info.size, (unsigned long long)info.map_size,
+      info.nr_chunks, info.chunk_size);
+  printf("pmd faults %llu, pte faults %llu\n",
+      (unsigned long long)info.pmd_faults, (unsigned long long)info.pte_faults);
+
+  munmap(p, info.map_size);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,203 @@
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
+#include <linux/uio.h>
+
+#include "../gblfifo_async/gblfifo_core.h"
+
+#define TEST_RING 16
+
+#define BENCH_BYTES (64UL << 20)
+#define BENCH_RING (64U << 10)
+
+static uint8_t *gblfifo_test_ring(struct kunit *test, unsigned size) {
+  uint8_t *mem = kunit_kzalloc(test, size, GFP_KERNEL);
+
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mem);
+  return mem;
+}
+
+/* copy_from_iter reads a WRITE iterator, copy_to_iter fills a READ one */
+static size_t gblfifo_test_put(uint8_t *mem, unsigned size, unsigned pos,
+    const void *src, size_t len) {
+  struct kvec kv = {.iov_base = (void *)src, .iov_len = len};
+  struct iov_iter iter;
+
+  iov_iter_kvec(&iter, WRITE, &kv, 1, len);
+  return gblfifo_mem_copy_from_iter(mem, size, pos, len, &iter);
+}
+
+static size_t gblfifo_test_get(uint8_t *mem, unsigned size, unsigned pos,
+    void *dst, size_t len, size_t room) {
+  struct kvec kv = {.iov_base = dst, .iov_len = room};
+  struct iov_iter iter;
+
+  iov_iter_kvec(&iter, READ, &kv, 1, room);
+  return gblfifo_mem_copy_to_iter(mem, size, pos, len, &iter);
+}
+
+static void gblfifo_test_used(struct kunit *test) {
+  KUNIT_EXPECT_EQ(test, 0U, gblfifo_used(7, 7, TEST_RING));
+  KUNIT_EXPECT_EQ(test, 2U, gblfifo_used(5, 3, TEST_RING));
+  /* head has wrapped past UINT_MAX, tail not yet */
+  KUNIT_EXPECT_EQ(test, 4U, gblfifo_used(2, UINT_MAX - 1, TEST_RING));
+  KUNIT_EXPECT_EQ(test, (unsigned)TEST_RING,
+      gblfifo_used(TEST_RING, 0, TEST_RING));
+  /* indices a mapped peer scribbled on never report more than size */
+  KUNIT_EXPECT_EQ(test, (unsigned)TEST_RING, gblfifo_used(100, 0, TEST_RING));
+  KUNIT_EXPECT_EQ(test, (unsigned)TEST_RING, gblfifo_used(0, 1, TEST_RING));
+}
+
+static void gblfifo_test_copy_linear(struct kunit *test) {
+  uint8_t *mem = gblfifo_test_ring(test, TEST_RING);
+  char out[8] = {};
+
+  KUNIT_EXPECT_EQ(test, (size_t)5, gblfifo_test_put(mem, TEST_RING, 2,
+      "hello", 5));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(mem + 2, "hello", 5));
+  KUNIT_EXPECT_EQ(test, (size_t)5,
+      gblfifo_test_get(mem, TEST_RING, 2, out, 5, sizeof(out)));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(out, "hello", 5));
+}
+
+static void gblfifo_test_copy_wrap(struct kunit *test) {
+  uint8_t *mem = gblfifo_test_ring(test, TEST_RING);
+  char out[8] = {};
+
+  /* free running: only the low bits of pos pick the offset */
+  KUNIT_EXPECT_EQ(test, (size_t)8, gblfifo_test_put(mem, TEST_RING,
+      UINT_MAX - 3, "ABCDEFGH", 8));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(mem + 12, "ABCD", 4));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(mem, "EFGH", 4));
+  KUNIT_EXPECT_EQ(test, (size_t)8,
+      gblfifo_test_get(mem, TEST_RING, 12, out, 8, sizeof(out)));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(out, "ABCDEFGH", 8));
+}
+
+static void gblfifo_test_copy_full(struct kunit *test) {
+  uint8_t *mem = gblfifo_test_ring(test, TEST_RING);
+  char in[TEST_RING], out[TEST_RING];
+  int i;
+
+  for (i = 0; i < TEST_RING; i++) in[i] = 'a' + i;
+  KUNIT_EXPECT_EQ(test, (size_t)TEST_RING,
+      gblfifo_test_put(mem, TEST_RING, 9, in, TEST_RING));
+  KUNIT_EXPECT_EQ(test, (size_t)TEST_RING,
+      gblfifo_test_get(mem, TEST_RING, 9, out, TEST_RING, TEST_RING));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(in, out, TEST_RING));
+}
+
+/* a short user buffer stops the copy where it ran out, across the wrap */
+static void gblfifo_test_copy_short(struct kunit *test) {
+  uint8_t *mem = gblfifo_test_ring(test, TEST_RING);
+  char out[8] = {};
+
+  gblfifo_test_put(mem, TEST_RING, 12, "ABCDEFGH", 8);
+  KUNIT_EXPECT_EQ(test, (size_t)5,
+      gblfifo_test_get(mem, TEST_RING, 12, out, 8, 5));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(out, "ABCDE", 5));
+  KUNIT_EXPECT_EQ(test, (size_t)3,
+      gblfifo_test_get(mem, TEST_RING, 12, out, 8, 3));
+}
+
+static void gblfifo_test_hdr(struct kunit *test) {
+  uint8_t *mem = gblfifo_test_ring(test, TEST_RING);
+  u32 hdr = 0x11223344;
+
+  gblfifo_mem_poke_hdr(mem, TEST_RING, 4, hdr);
+  KUNIT_EXPECT_EQ(test, hdr, gblfifo_mem_peek_hdr(mem, TEST_RING, 4));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(mem + 4, &hdr, GBLFIFO_REC_HDR));
+
+  /* a header split over the end of the ring */
+  hdr = 0xdeadbeef;
+  gblfifo_mem_poke_hdr(mem, TEST_RING, TEST_RING * 3 + 14, hdr);
+  KUNIT_EXPECT_EQ(test, hdr, gblfifo_mem_peek_hdr(mem, TEST_RING, 14));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(mem + 14, &hdr, 2));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(mem, (u8 *)&hdr + 2, 2));
+}
+
+static void gblfifo_test_hist(struct kunit *test) {
+  KUNIT_EXPECT_EQ(test, 0U, gblfifo_hist_bucket(0));
+  KUNIT_EXPECT_EQ(test, 1U, gblfifo_hist_bucket(1));
+  KUNIT_EXPECT_EQ(test, 2U, gblfifo_hist_bucket(2));
+  KUNIT_EXPECT_EQ(test, 2U, gblfifo_hist_bucket(3));
+  KUNIT_EXPECT_EQ(test, 11U, gblfifo_hist_bucket(1024));
+  KUNIT_EXPECT_EQ(test, 10U, gblfifo_hist_bucket(1023));
+  /* everything past the last bucket piles up in it */
+  KUNIT_EXPECT_EQ(test, (unsigned)GBLFIFO_HIST_BUCKETS - 1,
+      gblfifo_hist_bucket(1ULL << (GBLFIFO_HIST_BUCKETS - 2)));
+  KUNIT_EXPECT_EQ(test, (unsigned)GBLFIFO_HIST_BUCKETS - 1,
+      gblfifo_hist_bucket(U64_MAX));
+
+  /* a wait lands in the bucket whose bounds hold it */
+  KUNIT_EXPECT_EQ(test, 0ULL, gblfifo_hist_lo(0));
+  KUNIT_EXPECT_EQ(test, 1ULL, gblfifo_hist_lo(1));
+  KUNIT_EXPECT_EQ(test, 512ULL, gblfifo_hist_lo(gblfifo_hist_bucket(1023)));
+  KUNIT_EXPECT_EQ(test, 1024ULL, gblfifo_hist_lo(gblfifo_hist_bucket(1024)));
+}
+
+/*
+ * Each size is copied in and out once from the start of the ring and once
+ * straddling its end, which is the split the read and write paths pay for.
+ * cycles read 0 where there is no cycle counter (UML), ns always work.
+ */
+static void gblfifo_test_bench(struct kunit *test) {
+  static const size_t sizes[] = {16, 256, 4096, BENCH_RING};
+  uint8_t *mem = gblfifo_test_ring(test, BENCH_RING);
+  char *buf = kunit_kzalloc(test, BENCH_RING, GFP_KERNEL);
+  size_t k;
+
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+  for (k = 0; k < ARRAY_SIZE(sizes); k++) {
+    size_t len = sizes[k];
+    unsigned long i, iters = BENCH_BYTES / len;
+    unsigned pos[] = {0, BENCH_RING - len / 2};
+    int wrap;
+
+    for (wrap = 0; wrap <= 1; wrap++) {
+      cycles_t c_in, c_out;
+      u64 ns_in, ns_out;
+
+      c_in = get_cycles();
+      ns_in = ktime_get_ns();
+      for (i = 0; i < iters; i++)
+        gblfifo_test_put(mem, BENCH_RING, pos[wrap], buf, len);
+      c_in = get_cycles() - c_in;
+      ns_in = ktime_get_ns() - ns_in;
+
+      c_out = get_cycles();
+      ns_out = ktime_get_ns();
+      for (i = 0; i < iters; i++)
+        gblfifo_test_get(mem, BENCH_RING, pos[wrap], buf, len, len);
+      c_out = get_cycles() - c_out;
+      ns_out = ktime_get_ns() - ns_out;
+
+      kunit_info(test,
+          "%6zu bytes %s: in %llu cycles %llu ns, out %llu cycles %llu ns\n",
+          len, wrap ? "wrapped" : "linear ", (u64)c_in / iters,
+          ns_in / iters, (u64)c_out / iters, ns_out / iters);
+    }
+  }
+}
+
+static struct kunit_case gblfifo_test_cases[] = {
+    KUNIT_CASE(gblfifo_test_used),
+    KUNIT_CASE(gblfifo_test_copy_linear),
+    KUNIT_CASE(gblfifo_test_copy_wrap),
+    KUNIT_CASE(gblfifo_test_copy_full),
+    KUNIT_CASE(gblfifo_test_copy_short),
+    KUNIT_CASE(gblfifo_test_hdr),
+    KUNIT_CASE(gblfifo_test_hist),
+    KUNIT_CASE(gblfifo_test_bench),
+    {},
+};
+
+static struct kunit_suite gblfifo_test_suite = {
+    .name = "gblfifo",
+    .test_cases = gblfifo_test_cases,
+};
+kunit_test_suites(&gblfifo_test_suite);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,85 @@
+#include <kunit/test.h>
+
+#include "../gblmem-v2/gblmem_core.h"
+
+#define TEST_SIZE 4096
+
+static void gblmem_test_clamp(struct kunit *test) {
+  KUNIT_EXPECT_EQ(test, (size_t)16, gblmem_clamp(0, 16, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (size_t)TEST_SIZE, gblmem_clamp(0, 1 << 20, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (size_t)1, gblmem_clamp(TEST_SIZE - 1, 16, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (size_t)0, gblmem_clamp(TEST_SIZE, 16, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (size_t)0, gblmem_clamp(LLONG_MAX, 16, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (size_t)0, gblmem_clamp(-1, 16, TEST_SIZE));
+  /* pos + len would overflow, only the part inside the region counts */
+  KUNIT_EXPECT_EQ(test, (size_t)96, gblmem_clamp(4000, SIZE_MAX, TEST_SIZE));
+}
+
+static void gblmem_test_seek_set(struct kunit *test) {
+  KUNIT_EXPECT_EQ(test, 0LL, gblmem_seek_pos(100, 0, SEEK_SET, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, 123LL, gblmem_seek_pos(100, 123, SEEK_SET, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)TEST_SIZE,
+      gblmem_seek_pos(0, TEST_SIZE, SEEK_SET, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(0, TEST_SIZE + 1, SEEK_SET, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(0, -1, SEEK_SET, TEST_SIZE));
+}
+
+/* positions past 4 GiB used to be truncated to an unsigned int */
+static void gblmem_test_seek_large(struct kunit *test) {
+  loff_t big = 5LL << 30;
+
+  if (sizeof(size_t) < sizeof(loff_t)) return;
+  KUNIT_EXPECT_EQ(test, big,
+      gblmem_seek_pos(0, big, SEEK_SET, SIZE_MAX));
+}
+
+static void gblmem_test_seek_cur(struct kunit *test) {
+  KUNIT_EXPECT_EQ(test, 150LL, gblmem_seek_pos(100, 50, SEEK_CUR, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, 0LL, gblmem_seek_pos(100, -100, SEEK_CUR, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(100, -101, SEEK_CUR, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(100, TEST_SIZE, SEEK_CUR, TEST_SIZE));
+  /* pos + offset must not wrap around into range */
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(100, LLONG_MAX, SEEK_CUR, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(-100, LLONG_MIN, SEEK_CUR, TEST_SIZE));
+}
+
+static void gblmem_test_seek_end(struct kunit *test) {
+  KUNIT_EXPECT_EQ(test, (loff_t)TEST_SIZE,
+      gblmem_seek_pos(7, 0, SEEK_END, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)TEST_SIZE - 16,
+      gblmem_seek_pos(7, -16, SEEK_END, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(7, 1, SEEK_END, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(7, -TEST_SIZE - 1, SEEK_END, TEST_SIZE));
+}
+
+static void gblmem_test_seek_whence(struct kunit *test) {
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL,
+      gblmem_seek_pos(0, 0, SEEK_DATA, TEST_SIZE));
+  KUNIT_EXPECT_EQ(test, (loff_t)-EINVAL, gblmem_seek_pos(0, 0, 42, TEST_SIZE));
+}
+
+static struct kunit_case gblmem_test_cases[] = {
+    KUNIT_CASE(gblmem_test_clamp),
+    KUNIT_CASE(gblmem_test_seek_set),
+    KUNIT_CASE(gblmem_test_seek_large),
+    KUNIT_CASE(gblmem_test_seek_cur),
+    KUNIT_CASE(gblmem_test_seek_end),
+    KUNIT_CASE(gblmem_test_seek_whence),
+    {},
+};
+
+static struct kunit_suite gblmem_test_suite = {
+    .name = "gblmem",
+    .test_cases = gblmem_test_cases,
+};
+kunit_test_suites(&gblmem_test_suite);
+
+MODULE_LICENSE("GPL");
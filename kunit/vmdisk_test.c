@@ -0,0 +1,124 @@
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
+
+#include "../vmdisk/vmdisk_transfer.h"
+
+#define TEST_SECTORS 64
+#define TEST_SIZE (TEST_SECTORS * HARDSECT_SIZE)
+
+/* enough copies per size that the clock granularity disappears */
+#define BENCH_BYTES (64UL << 20)
+#define BENCH_MAX (1UL << 20)
+
+struct vmdisk_test {
+  uint8_t *data;
+  char *buf;
+};
+
+static int vmdisk_test_init(struct kunit *test) {
+  struct vmdisk_test *t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+  t->data = kunit_kzalloc(test, TEST_SIZE, GFP_KERNEL);
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->data);
+  t->buf = kunit_kzalloc(test, TEST_SIZE, GFP_KERNEL);
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t->buf);
+  test->priv = t;
+  return 0;
+}
+
+static void vmdisk_test_roundtrip(struct kunit *test) {
+  struct vmdisk_test *t = test->priv;
+  size_t off = 3 * HARDSECT_SIZE, len = 2 * HARDSECT_SIZE, i;
+
+  for (i = 0; i < len; i++) t->buf[i] = i * 7 + 1;
+  KUNIT_EXPECT_EQ(test, 0, vmdisk_copy(t->data, TEST_SIZE, 3, 2, t->buf, 1));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(t->data + off, t->buf, len));
+  /* nothing outside the two sectors moved */
+  KUNIT_EXPECT_PTR_EQ(test, NULL, memchr_inv(t->data, 0, off));
+  KUNIT_EXPECT_PTR_EQ(test, NULL,
+      memchr_inv(t->data + off + len, 0, TEST_SIZE - off - len));
+
+  memset(t->buf, 0, len);
+  KUNIT_EXPECT_EQ(test, 0, vmdisk_copy(t->data, TEST_SIZE, 3, 2, t->buf, 0));
+  KUNIT_EXPECT_EQ(test, 0, memcmp(t->data + off, t->buf, len));
+}
+
+static void vmdisk_test_last_sector(struct kunit *test) {
+  struct vmdisk_test *t = test->priv;
+
+  memset(t->buf, 0xa5, HARDSECT_SIZE);
+  KUNIT_EXPECT_EQ(test, 0,
+      vmdisk_copy(t->data, TEST_SIZE, TEST_SECTORS - 1, 1, t->buf, 1));
+  KUNIT_EXPECT_EQ(test, (uint8_t)0xa5, t->data[TEST_SIZE - 1]);
+  /* an empty transfer right at the end is still in range */
+  KUNIT_EXPECT_EQ(test, 0,
+      vmdisk_copy(t->data, TEST_SIZE, TEST_SECTORS, 0, t->buf, 0));
+}
+
+static void vmdisk_test_beyond_end(struct kunit *test) {
+  struct vmdisk_test *t = test->priv;
+
+  memset(t->buf, 0xff, TEST_SIZE);
+  KUNIT_EXPECT_EQ(test, -EIO,
+      vmdisk_copy(t->data, TEST_SIZE, TEST_SECTORS - 1, 2, t->buf, 1));
+  KUNIT_EXPECT_EQ(test, -EIO,
+      vmdisk_copy(t->data, TEST_SIZE, TEST_SECTORS, 1, t->buf, 1));
+  /* sector * 512 and offset + nbytes must not wrap back into range */
+  KUNIT_EXPECT_EQ(test, -EIO,
+      vmdisk_copy(t->data, TEST_SIZE, ULONG_MAX / HARDSECT_SIZE + 1, 1,
+          t->buf, 1));
+  KUNIT_EXPECT_EQ(test, -EIO,
+      vmdisk_copy(t->data, TEST_SIZE, 1, ULONG_MAX / HARDSECT_SIZE, t->buf,
+          1));
+  KUNIT_EXPECT_PTR_EQ(test, NULL, memchr_inv(t->data, 0, TEST_SIZE));
+}
+
+/* cycles read 0 where there is no cycle counter (UML), ns always work */
+static void vmdisk_test_bench(struct kunit *test) {
+  static const size_t sizes[] = {HARDSECT_SIZE, 4096, 65536, BENCH_MAX};
+  uint8_t *data = kunit_kzalloc(test, BENCH_MAX, GFP_KERNEL);
+  char *buf = kunit_kzalloc(test, BENCH_MAX, GFP_KERNEL);
+  size_t k;
+
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, data);
+  KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+  for (k = 0; k < ARRAY_SIZE(sizes); k++) {
+    size_t bytes = sizes[k];
+    unsigned long nsect = bytes / HARDSECT_SIZE, iters = BENCH_BYTES / bytes;
+    unsigned long i;
+    int write;
+
+    for (write = 0; write <= 1; write++) {
+      cycles_t c = get_cycles();
+      u64 ns = ktime_get_ns();
+
+      for (i = 0; i < iters; i++)
+        vmdisk_copy(data, BENCH_MAX, 0, nsect, buf, write);
+      c = get_cycles() - c;
+      ns = ktime_get_ns() - ns;
+      kunit_info(test, "%7zu bytes %s: %llu cycles %llu ns per copy\n", bytes,
+          write ? "write" : "read ", (u64)c / iters, ns / iters);
+    }
+  }
+}
+
+static struct kunit_case vmdisk_test_cases[] = {
+    KUNIT_CASE(vmdisk_test_roundtrip),
+    KUNIT_CASE(vmdisk_test_last_sector),
+    KUNIT_CASE(vmdisk_test_beyond_end),
+    KUNIT_CASE(vmdisk_test_bench),
+    {},
+};
+
+static struct kunit_suite vmdisk_test_suite = {
+    .name = "vmdisk",
+    .init = vmdisk_test_init,
+    .test_cases = vmdisk_test_cases,
+};
+kunit_test_suites(&vmdisk_test_suite);
+
+MODULE_LICENSE("GPL");
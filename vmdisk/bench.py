@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""fio benchmark matrix for vmdisk.
+
+  bench.py run [--nsectors N] [--backing PATH] [--runtime S]
+               [--out results.json]
+      (re)load vmdisk.ko with the given parameters and run the matrix, with
+      --backing vmdisk caches PATH in nsectors of RAM
+  bench.py compare baseline.json results.json [--threshold PCT]
+      flag jobs whose IOPS dropped or p99 latency grew by more than PCT
+      percent, exits 1 if any did
+"""
+
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+MODULE = os.path.join(HERE, "vmdisk.ko")
+DEVICE = "/dev/vmem_disk"
+
+# (name, block size, fio rw, extra fio args)
+WORKLOADS = [
+    ("4k-randread", "4k", "randread", []),
+    ("4k-randwrite", "4k", "randwrite", []),
+    ("4k-randrw", "4k", "randrw", ["--rwmixread=70"]),
+    ("1m-read", "1m", "read", []),
+    ("1m-write", "1m", "write", []),
+    ("1m-rw", "1m", "rw", ["--rwmixread=70"]),
+]
+ENGINES = ["psync", "libaio", "io_uring"]
+DEPTHS = [1, 4, 16, 32, 128]
+
+
+def jobs():
+    for name, bs, rw, extra in WORKLOADS:
+        for engine in ENGINES:
+            # a sync engine has one I/O in flight whatever iodepth says
+            for qd in [1] if engine == "psync" else DEPTHS:
+                yield "%s-%s-qd%d" % (name, engine, qd), bs, rw, engine, qd, extra
+
+
+def load_module(params):
+    subprocess.run(["rmmod", "vmdisk"], stderr=subprocess.DEVNULL)
+    args = ["%s=%s" % kv for kv in params.items()]
+    subprocess.run(["insmod", MODULE] + args, check=True)
+    for _ in range(50):
+        if os.path.exists(DEVICE):
+            return
+        time.sleep(0.1)
+    sys.exit("%s did not show up" % DEVICE)
+
+
+def run_fio(bs, rw, engine, qd, extra, runtime):
+    cmd = [
+        "fio", "--name=vmdisk", "--filename=" + DEVICE, "--direct=1",
+        "--bs=" + bs, "--rw=" + rw, "--ioengine=" + engine,
+        "--iodepth=%d" % qd, "--runtime=%d" % runtime, "--time_based",
+        "--ramp_time=1", "--output-format=json",
+    ] + extra
+    out = subprocess.run(cmd, check=True, stdout=subprocess.PIPE).stdout
+    job = json.loads(out)["jobs"][0]
+
+    result = {"iops": 0.0, "bw_mib": 0.0}
+    p99 = []
+    for ddir in ("read", "write"):
+        d = job[ddir]
+        if d["total_ios"] == 0:
+            continue
+        result["iops"] += d["iops"]
+        result["bw_mib"] += d["bw"] / 1024.0
+        pct = d["clat_ns"].get("percentile", {})
+        result["%s_p50_us" % ddir] = pct.get("50.000000", 0) / 1000.0
+        result["%s_p99_us" % ddir] = pct.get("99.000000", 0) / 1000.0
+        result["%s_p999_us" % ddir] = pct.get("99.900000", 0) / 1000.0
+        p99.append(result["%s_p99_us" % ddir])
+    result["p99_us"] = max(p99) if p99 else 0.0
+    return result
+
+
+def cmd_run(args):
+    if os.geteuid() != 0:
+        sys.exit("run needs root to load the module")
+
+    params = {"nsectors": args.nsectors}
+    if args.backing:
+        params["backing"] = args.backing
+    load_module(params)
+
+    results = {
+        "kernel": platform.release(),
+        "params": params,
+        "runtime": args.runtime,
+        "jobs": {},
+    }
+    for name, bs, rw, engine, qd, extra in jobs():
+        r = run_fio(bs, rw, engine, qd, extra, args.runtime)
+        results["jobs"][name] = r
+        print("%-28s %10.0f IOPS %9.1f MiB/s p99 %8.1f us" %
+              (name, r["iops"], r["bw_mib"], r["p99_us"]), flush=True)
+
+    with open(args.out, "w") as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+    print("results in", args.out)
+
+
+def cmd_compare(args):
+    with open(args.baseline) as f:
+        base = json.load(f)["jobs"]
+    with open(args.results) as f:
+        new = json.load(f)["jobs"]
+
+    limit = args.threshold / 100.0
+    regressions = 0
+    for name in sorted(set(base) & set(new)):
+        b, n = base[name], new[name]
+        iops = n["iops"] / b["iops"] - 1 if b["iops"] else 0.0
+        p99 = n["p99_us"] / b["p99_us"] - 1 if b["p99_us"] else 0.0
+        bad = iops < -limit or p99 > limit
+        regressions += bad
+        print("%-28s IOPS %+6.1f%%  p99 %+6.1f%%%s" %
+              (name, iops * 100, p99 * 100, "  REGRESSION" if bad else ""))
+
+    for name in sorted(set(base) ^ set(new)):
+        print("%-28s only in %s" %
+              (name, "baseline" if name in base else "results"))
+
+    print("%d regression(s) beyond %.1f%%" % (regressions, args.threshold))
+    return 1 if regressions else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    run = sub.add_parser("run")
+    run.add_argument("--nsectors", type=int, default=2 * 1024 * 1024,
+                     help="disk size in 512 byte sectors (default 1 GiB)")
+    run.add_argument("--backing",
+                     help="device or file to cache, the disk takes its size")
+    run.add_argument("--runtime", type=int, default=10,
+                     help="seconds per job")
+    run.add_argument("--out", default="results.json")
+
+    compare = sub.add_parser("compare")
+    compare.add_argument("baseline")
+    compare.add_argument("results")
+    compare.add_argument("--threshold", type=float, default=5.0)
+
+    args = parser.parse_args()
+    if args.cmd == "run":
+        cmd_run(args)
+        return 0
+    return cmd_compare(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
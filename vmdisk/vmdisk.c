@@ -1,77 +1,508 @@
 #include <linux/bio.h>
+#include <linux/bitmap.h>
 #include <linux/blkdev.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
 #include <linux/init.h>
 #include <linux/major.h>
+#include <linux/mempool.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched/mm.h>
+#include <linux/sort.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 #include <uapi/linux/hdreg.h>
 
+#include "vmdisk_transfer.h"
+
+#define CREATE_TRACE_POINTS
+#include "vmdisk_trace.h"
+
+/* the cache works in chunks of 64 KiB of the backing store */
+#define VMDISK_CHUNK_SHIFT 7
+#define VMDISK_CHUNK_SECTORS (1U << VMDISK_CHUNK_SHIFT)
+#define VMDISK_CHUNK_BYTES (VMDISK_CHUNK_SECTORS * HARDSECT_SIZE)
+#define VMDISK_MIN_IOS 16 /* bios the pool always has room for */
+
+/*
+ * A chunk of the backing store held in RAM. A sector is valid once it was
+ * read in or written, and dirty until writeback has put it back. A slot
+ * under writeback stays mapped even if it looks clean. While filling, a
+ * read brings in the sectors that aren't valid without holding the lock,
+ * writes and reads of those sectors wait for it on fill_wait.
+ */
+struct vmdisk_slot {
+  sector_t chunk; /* while mapped */
+  bool mapped, referenced, writeback, filling;
+  DECLARE_BITMAP(valid, VMDISK_CHUNK_SECTORS);
+  DECLARE_BITMAP(dirty, VMDISK_CHUNK_SECTORS);
+};
+
+/* a dirty slot as one writeback pass found it */
+struct vmdisk_wb {
+  sector_t chunk;
+  unsigned slot;
+  int err;
+  DECLARE_BITMAP(dirty, VMDISK_CHUNK_SECTORS);
+};
+
+/*
+ * Cache mode, when backing is set. data holds nr_slots chunks, map finds
+ * them by chunk number and the clock hand picks the clean ones to reuse.
+ * Each bio is served by a work item of its own on wq, so a miss doesn't
+ * hold up the bios behind it. Reading the backing store from make_request
+ * would leave its bios queued on current->bio_list behind ours. wb_work
+ * writes dirty chunks back in chunk order.
+ */
+struct vmdisk_cache {
+  struct file *backing;
+  struct vmdisk_slot *slots;
+  unsigned nr_slots, hand, nr_dirty, nr_filling;
+  struct xarray map;
+  struct mutex lock;    /* slots, map, hand, nr_dirty, nr_filling */
+  struct mutex wb_lock; /* one writeback pass at a time, and batch */
+  struct vmdisk_wb *batch;
+  wait_queue_head_t fill_wait; /* for slots to stop filling */
+  mempool_t *io_pool;          /* struct vmdisk_io */
+  struct workqueue_struct *wq;
+  struct delayed_work wb_work;
+  u64 hits, misses, evictions, written_back;
+};
+
+/* a bio on its way to the workqueue */
+struct vmdisk_io {
+  struct work_struct work;
+  struct vmdisk_dev *devp;
+  struct bio *bio;
+};
+
 struct vmdisk_dev {
-  size_t size;
+  size_t size; /* of the disk, data is smaller in cache mode */
   uint8_t *data;
   spinlock_t lock;
   struct request_queue *queue;
   struct gendisk *gd;
+  struct vmdisk_cache cache;
 };
 
 static int VMDISK_MAJOR = 0;
 #define NSECTORS 4096
-#define HARDSECT_SIZE 512
 #define VMDISK_NAME "vmem_disk"
 
+static unsigned long nsectors = NSECTORS;
+module_param(nsectors, ulong, 0444);
+MODULE_PARM_DESC(nsectors, "RAM sectors: the disk, or the cache with backing");
+
+static char *backing;
+module_param(backing, charp, 0444);
+MODULE_PARM_DESC(backing, "block device or file to cache, sets the disk size");
+
+static unsigned writeback_ms = 1000;
+module_param(writeback_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_ms, "most time written data waits for writeback");
+
+static unsigned dirty_pct = 50;
+module_param(dirty_pct, uint, 0644);
+MODULE_PARM_DESC(dirty_pct, "share of dirty slots that starts writeback early");
+
 struct vmdisk_dev vmdisk_shared_data;
 
-static void vmdisk_transfer(struct vmdisk_dev *devp, unsigned long sector,
+static int vmdisk_transfer(struct vmdisk_dev *devp, unsigned long sector,
     unsigned long nsect, char *buffer, int write) {
-  unsigned long offset = sector * HARDSECT_SIZE;
-  unsigned long nbytes = nsect * HARDSECT_SIZE;
+  int ret = vmdisk_copy(devp->data, devp->size, sector, nsect, buffer, write);
+
+  pr_debug("%s sector %lu nsect %lu: %d\n", write ? "write" : "read", sector,
+      nsect, ret);
+  if (ret)
+    printk_ratelimited(KERN_NOTICE "beyond-end %s (%lu %lu)\n",
+        write ? "write" : "read", sector, nsect);
+  return ret;
+}
+
+static blk_status_t vmdisk_xfer_bio(struct vmdisk_dev *devp, struct bio *bio) {
+  struct bio_vec bvec;
+  struct bvec_iter iter;
+  sector_t sector = bio->bi_iter.bi_sector;
+  blk_status_t status = BLK_STS_OK;
 
-  if ((offset + nbytes) > devp->size) {
-    printk(KERN_NOTICE "beyond-end write (%ld %ld)\n", offset, nbytes);
-    return;
+  bio_for_each_segment(bvec, bio, iter) {
+    char *buffer = __bio_kmap_atomic(bio, iter);
+    /* bio_cur_bytes() would be the first segment's length every time */
+    if (vmdisk_transfer(devp, sector, bvec.bv_len >> 9, buffer,
+            bio_data_dir(bio) == WRITE))
+      status = BLK_STS_IOERR;
+    sector += bvec.bv_len >> 9;
+    __bio_kunmap_atomic(buffer);
   }
 
-  if (write)
-    memcpy(devp->data + offset, buffer, nbytes);
+  return status;
+}
+
+static uint8_t *vmdisk_slot_data(
+    struct vmdisk_dev *devp, struct vmdisk_slot *s) {
+  return devp->data + (size_t)(s - devp->cache.slots) * VMDISK_CHUNK_BYTES;
+}
+
+static bool vmdisk_slot_dirty(struct vmdisk_slot *s) {
+  return !bitmap_empty(s->dirty, VMDISK_CHUNK_SECTORS);
+}
+
+static bool vmdisk_slot_valid(
+    struct vmdisk_slot *s, unsigned off, unsigned nsect) {
+  return find_next_zero_bit(s->valid, off + nsect, off) >= off + nsect;
+}
+
+/*
+ * Read each run of sectors that isn't valid straight into the slot, zeros
+ * past the end of the backing store. Called on a filling slot without the
+ * lock: nothing else touches those sectors or the valid bits meanwhile.
+ */
+static int vmdisk_fill_slot(struct vmdisk_dev *devp, struct vmdisk_slot *s) {
+  uint8_t *data = vmdisk_slot_data(devp, s);
+  unsigned start, end = 0;
+  size_t len;
+  ssize_t n;
+  loff_t pos;
+
+  for (;;) {
+    start = find_next_zero_bit(s->valid, VMDISK_CHUNK_SECTORS, end);
+    if (start >= VMDISK_CHUNK_SECTORS) return 0;
+    end = find_next_bit(s->valid, VMDISK_CHUNK_SECTORS, start);
+
+    pos = ((loff_t)s->chunk * VMDISK_CHUNK_SECTORS + start) * HARDSECT_SIZE;
+    len = (end - start) * HARDSECT_SIZE;
+    n = kernel_read(
+        devp->cache.backing, data + start * HARDSECT_SIZE, len, &pos);
+    if (n < 0) return n;
+    memset(data + start * HARDSECT_SIZE + n, 0, len - n);
+  }
+}
+
+/*
+ * The slot holding chunk, or a clean one mapped to it, hit says which.
+ * Clock: a slot used since the hand last passed gets another round. NULL
+ * if every slot is dirty, filling or under writeback. Called with lock
+ * held.
+ */
+static struct vmdisk_slot *vmdisk_get_slot(
+    struct vmdisk_cache *c, sector_t chunk, bool *hit) {
+  struct vmdisk_slot *s = xa_load(&c->map, chunk);
+  unsigned i;
+  int err;
+
+  *hit = s != NULL;
+  if (s) {
+    s->referenced = true;
+    return s;
+  }
+
+  for (i = 0; i < 2 * c->nr_slots; i++) {
+    s = &c->slots[c->hand];
+    c->hand = (c->hand + 1) % c->nr_slots;
+    if (s->writeback || s->filling || vmdisk_slot_dirty(s)) continue;
+    if (s->referenced) {
+      s->referenced = false;
+      continue;
+    }
+
+    if (s->mapped) {
+      xa_erase(&c->map, s->chunk);
+      s->mapped = false;
+      c->evictions++;
+    }
+    /* we may be writing out pages for reclaim */
+    err = xa_err(xa_store(&c->map, chunk, s, GFP_NOIO));
+    if (err) return ERR_PTR(err);
+    s->chunk = chunk;
+    s->mapped = s->referenced = true;
+    bitmap_zero(s->valid, VMDISK_CHUNK_SECTORS);
+    return s;
+  }
+  return NULL;
+}
+
+static int vmdisk_writeback(struct vmdisk_dev *devp);
+
+static void vmdisk_dirtied(struct vmdisk_cache *c) {
+  c->nr_dirty++;
+  if (c->nr_dirty * 100 >= (u64)dirty_pct * c->nr_slots)
+    mod_delayed_work(c->wq, &c->wb_work, 0);
   else
-    memcpy(buffer, devp->data + offset, nbytes);
+    queue_delayed_work(c->wq, &c->wb_work, msecs_to_jiffies(writeback_ms));
+}
+
+/*
+ * nsect sectors at sector, all inside one chunk. A read miss brings in the
+ * whole chunk, a write needs none of it. Takes and drops lock, and drops
+ * it around the backing store read too.
+ */
+static int vmdisk_cache_transfer(struct vmdisk_dev *devp, sector_t sector,
+    unsigned nsect, char *buffer, bool write) {
+  struct vmdisk_cache *c = &devp->cache;
+  unsigned off = sector & (VMDISK_CHUNK_SECTORS - 1);
+  struct vmdisk_slot *s;
+  bool hit, counted = false;
+  uint8_t *data;
+  int err;
+
+  if (sector + nsect > devp->size / HARDSECT_SIZE) return -EIO;
+
+  for (;;) {
+    mutex_lock(&c->lock);
+    s = vmdisk_get_slot(c, sector >> VMDISK_CHUNK_SHIFT, &hit);
+    if (IS_ERR(s)) {
+      mutex_unlock(&c->lock);
+      return PTR_ERR(s);
+    }
+    /* by the first look, however often we come back */
+    if (!counted) {
+      if (hit)
+        c->hits++;
+      else
+        c->misses++;
+      counted = true;
+    }
+    /* sectors that are already valid can be read while it fills */
+    if (s && (!s->filling || (!write && vmdisk_slot_valid(s, off, nsect))))
+      break;
+    mutex_unlock(&c->lock);
+
+    if (s) {
+      /* it may hold another chunk by the time we look again */
+      wait_event(c->fill_wait, !READ_ONCE(s->filling));
+      continue;
+    }
+    /* nothing clean to evict, make some */
+    err = vmdisk_writeback(devp);
+    if (err < 0) return err;
+    /* nothing was dirty either, every slot is filling */
+    if (!err)
+      wait_event(c->fill_wait, READ_ONCE(c->nr_filling) < c->nr_slots);
+  }
+
+  data = vmdisk_slot_data(devp, s);
+  err = 0;
+  if (write) {
+    memcpy(data + off * HARDSECT_SIZE, buffer, nsect * HARDSECT_SIZE);
+    bitmap_set(s->valid, off, nsect);
+    if (!vmdisk_slot_dirty(s)) vmdisk_dirtied(c);
+    bitmap_set(s->dirty, off, nsect);
+    goto out;
+  }
+
+  if (!vmdisk_slot_valid(s, off, nsect)) {
+    /* what was written since the chunk was mapped is newer, and stays */
+    s->filling = true;
+    c->nr_filling++;
+    mutex_unlock(&c->lock);
+    err = vmdisk_fill_slot(devp, s);
+    mutex_lock(&c->lock);
+    s->filling = false;
+    c->nr_filling--;
+    wake_up_all(&c->fill_wait);
+    if (err) goto out;
+    bitmap_fill(s->valid, VMDISK_CHUNK_SECTORS);
+  }
+  memcpy(buffer, data + off * HARDSECT_SIZE, nsect * HARDSECT_SIZE);
+
+out:
+  mutex_unlock(&c->lock);
+  pr_debug("cached %s sector %llu nsect %u: %d\n", write ? "write" : "read",
+      (unsigned long long)sector, nsect, err);
+  return err;
+}
+
+static int vmdisk_wb_cmp(const void *a, const void *b) {
+  const struct vmdisk_wb *x = a, *y = b;
+
+  if (x->chunk == y->chunk) return 0;
+  return x->chunk < y->chunk ? -1 : 1;
+}
+
+/* each run of dirty sectors in one write */
+static int vmdisk_write_runs(struct vmdisk_dev *devp, struct vmdisk_wb *b) {
+  uint8_t *data = devp->data + (size_t)b->slot * VMDISK_CHUNK_BYTES;
+  unsigned start, end = 0;
+  size_t len;
+  ssize_t n;
+  loff_t pos;
+
+  for (;;) {
+    start = find_next_bit(b->dirty, VMDISK_CHUNK_SECTORS, end);
+    if (start >= VMDISK_CHUNK_SECTORS) return 0;
+    end = find_next_zero_bit(b->dirty, VMDISK_CHUNK_SECTORS, start);
+
+    pos = ((loff_t)b->chunk * VMDISK_CHUNK_SECTORS + start) * HARDSECT_SIZE;
+    len = (end - start) * HARDSECT_SIZE;
+    n = kernel_write(
+        devp->cache.backing, data + start * HARDSECT_SIZE, len, &pos);
+    if (n < 0) return n;
+    if ((size_t)n != len) return -EIO;
+  }
+}
+
+/*
+ * Write every dirty chunk back in chunk order, so the backing store sees
+ * one ascending sweep of long writes. Sectors go clean before their copy
+ * is written, a write meanwhile just dirties them again. Returns how many
+ * chunks it wrote, or the first error, whatever failed stays dirty.
+ */
+static int vmdisk_writeback(struct vmdisk_dev *devp) {
+  struct vmdisk_cache *c = &devp->cache;
+  struct vmdisk_slot *s;
+  struct vmdisk_wb *b;
+  unsigned i, n = 0;
+  int err = 0;
+
+  mutex_lock(&c->wb_lock);
+
+  mutex_lock(&c->lock);
+  for (i = 0; i < c->nr_slots; i++) {
+    s = &c->slots[i];
+    if (!vmdisk_slot_dirty(s)) continue;
+    b = &c->batch[n++];
+    b->chunk = s->chunk;
+    b->slot = i;
+    bitmap_copy(b->dirty, s->dirty, VMDISK_CHUNK_SECTORS);
+    bitmap_zero(s->dirty, VMDISK_CHUNK_SECTORS);
+    s->writeback = true;
+    c->nr_dirty--;
+  }
+  mutex_unlock(&c->lock);
+
+  sort(c->batch, n, sizeof(*c->batch), vmdisk_wb_cmp, NULL);
+  for (i = 0; i < n; i++) {
+    b = &c->batch[i];
+    b->err = vmdisk_write_runs(devp, b);
+    if (b->err && !err) err = b->err;
+  }
+
+  mutex_lock(&c->lock);
+  for (i = 0; i < n; i++) {
+    b = &c->batch[i];
+    s = &c->slots[b->slot];
+    s->writeback = false;
+    if (!b->err) {
+      c->written_back++;
+      continue;
+    }
+    if (!vmdisk_slot_dirty(s)) c->nr_dirty++;
+    bitmap_or(s->dirty, s->dirty, b->dirty, VMDISK_CHUNK_SECTORS);
+  }
+  mutex_unlock(&c->lock);
+
+  mutex_unlock(&c->wb_lock);
+  pr_debug("writeback of %u chunks: %d\n", n, err);
+  return err ? err : n;
+}
+
+/* everything written so far reaches stable storage */
+static int vmdisk_flush(struct vmdisk_dev *devp) {
+  int err = vmdisk_writeback(devp);
+  int ret = vfs_fsync(devp->cache.backing, 0);
+
+  return err < 0 ? err : ret;
+}
+
+/*
+ * Both workers run in a noio scope, as the loop driver does: an allocation
+ * under the backing store's filesystem must not recurse into reclaim that
+ * waits on our own bios.
+ */
+static void vmdisk_wb_work(struct work_struct *work) {
+  struct vmdisk_dev *devp =
+      container_of(to_delayed_work(work), struct vmdisk_dev, cache.wb_work);
+  unsigned noio = memalloc_noio_save();
+  int err = vmdisk_writeback(devp);
+
+  memalloc_noio_restore(noio);
+
+  /* what failed is still dirty, try again later */
+  if (err < 0) {
+    printk_ratelimited(KERN_NOTICE "writeback failed: %d\n", err);
+    queue_delayed_work(devp->cache.wq, &devp->cache.wb_work,
+        msecs_to_jiffies(writeback_ms));
+  }
 }
 
-static int vmdisk_xfer_bio(struct vmdisk_dev *devp, struct bio *bio) {
+/* the bio split at chunk boundaries, preflush before and FUA after it */
+static blk_status_t vmdisk_cache_bio(struct vmdisk_dev *devp, struct bio *bio) {
   struct bio_vec bvec;
   struct bvec_iter iter;
   sector_t sector = bio->bi_iter.bi_sector;
+  bool write = op_is_write(bio_op(bio));
+  unsigned done, nsect;
+  char *buffer;
+  int err = 0;
+
+  if ((bio->bi_opf & REQ_PREFLUSH) && vmdisk_flush(devp))
+    return BLK_STS_IOERR;
 
   bio_for_each_segment(bvec, bio, iter) {
-    char *buffer = __bio_kmap_atomic(bio, iter);
-    vmdisk_transfer(devp, sector, bio_cur_bytes(bio) >> 9, buffer,
-        bio_data_dir(bio) == WRITE);
-    sector += bio_cur_bytes(bio) >> 9;
-    __bio_kunmap_atomic(buffer);
+    /* the copy may sleep on the backing store */
+    buffer = kmap(bvec.bv_page) + bvec.bv_offset;
+    for (done = 0; done < bvec.bv_len && !err; done += nsect * HARDSECT_SIZE) {
+      nsect = min_t(unsigned, (bvec.bv_len - done) / HARDSECT_SIZE,
+          VMDISK_CHUNK_SECTORS - (sector & (VMDISK_CHUNK_SECTORS - 1)));
+      err = vmdisk_cache_transfer(devp, sector, nsect, buffer + done, write);
+      sector += nsect;
+    }
+    kunmap(bvec.bv_page);
+    if (err) return BLK_STS_IOERR;
   }
 
-  return 0;
+  /* FUA comes with journal commits, which flush everything anyway */
+  if ((bio->bi_opf & REQ_FUA) && vmdisk_flush(devp)) return BLK_STS_IOERR;
+  return BLK_STS_OK;
+}
+
+static void vmdisk_io_work(struct work_struct *work) {
+  struct vmdisk_io *io = container_of(work, struct vmdisk_io, work);
+  struct vmdisk_dev *devp = io->devp;
+  struct bio *bio = io->bio;
+  unsigned noio = memalloc_noio_save();
+
+  mempool_free(io, devp->cache.io_pool);
+  bio->bi_status = vmdisk_cache_bio(devp, bio);
+  trace_vmdisk_bio_complete(bio, bio->bi_status);
+  bio_endio(bio);
+  memalloc_noio_restore(noio);
 }
 
 static blk_qc_t vmdisk_make_request(struct request_queue *q, struct bio *bio) {
-  int status;
   struct vmdisk_dev *devp = q->queuedata;
+  struct vmdisk_io *io;
+
+  trace_vmdisk_bio_submit(bio);
+  if (devp->cache.backing) {
+    /* can't fail, it waits for a running bio to hand one back */
+    io = mempool_alloc(devp->cache.io_pool, GFP_NOIO);
+    INIT_WORK(&io->work, vmdisk_io_work);
+    io->devp = devp;
+    io->bio = bio;
+    queue_work(devp->cache.wq, &io->work);
+    return BLK_QC_T_NONE;
+  }
 
-  status = vmdisk_xfer_bio(devp, bio);
+  bio->bi_status = vmdisk_xfer_bio(devp, bio);
+  trace_vmdisk_bio_complete(bio, bio->bi_status);
   bio_endio(bio);
 
   return BLK_QC_T_NONE;
 }
 
 static int vmdisk_getgeo(struct block_device *bdev, struct hd_geometry *geo) {
-  // struct vmdisk_dev *devp = bdev->bd_disk->private_data;
+  struct vmdisk_dev *devp = bdev->bd_disk->private_data;
+  unsigned long sectors = devp->size / HARDSECT_SIZE;
 
-  geo->cylinders = (NSECTORS & ~0x3f) >> 6;
+  geo->cylinders = (sectors & ~0x3f) >> 6;
   geo->heads = 4;
   geo->sectors = 16;
   geo->start = 4;
@@ -84,14 +515,91 @@ static struct block_device_operations vmdisk_ops = {
     .getgeo = vmdisk_getgeo,
 };
 
+static void vmdisk_cache_free(struct vmdisk_dev *devp) {
+  struct vmdisk_cache *c = &devp->cache;
+
+  if (!c->backing) return;
+  if (c->wq) destroy_workqueue(c->wq);
+  xa_destroy(&c->map);
+  mempool_destroy(c->io_pool);
+  vfree(c->batch);
+  vfree(c->slots);
+  vfree(devp->data);
+  devp->data = NULL;
+  filp_close(c->backing, NULL);
+  c->backing = NULL;
+}
+
+/*
+ * Open the backing store, whose size the disk takes, and carve nsectors
+ * of RAM into chunk slots.
+ */
+static int vmdisk_cache_init(struct vmdisk_dev *devp) {
+  struct vmdisk_cache *c = &devp->cache;
+  struct file *filp;
+
+  xa_init(&c->map);
+  mutex_init(&c->lock);
+  mutex_init(&c->wb_lock);
+  init_waitqueue_head(&c->fill_wait);
+  INIT_DELAYED_WORK(&c->wb_work, vmdisk_wb_work);
+
+  filp = filp_open(backing, O_RDWR | O_LARGEFILE, 0);
+  if (IS_ERR(filp)) {
+    printk(KERN_NOTICE "can't open %s: %ld\n", backing, PTR_ERR(filp));
+    return PTR_ERR(filp);
+  }
+  c->backing = filp;
+  /* a block device's size is on its bdev inode, not on the /dev node */
+  devp->size = i_size_read(filp->f_mapping->host) &
+               ~(loff_t)(HARDSECT_SIZE - 1);
+  c->nr_slots = max_t(unsigned long, nsectors >> VMDISK_CHUNK_SHIFT, 1);
+
+  devp->data = vmalloc(array_size(c->nr_slots, VMDISK_CHUNK_BYTES));
+  c->slots = vzalloc(array_size(c->nr_slots, sizeof(*c->slots)));
+  c->batch = vmalloc(array_size(c->nr_slots, sizeof(*c->batch)));
+  c->io_pool = mempool_create_kmalloc_pool(
+      VMDISK_MIN_IOS, sizeof(struct vmdisk_io));
+  /* bios for the backing store may be what frees memory */
+  c->wq = alloc_workqueue("vmdisk", WQ_MEM_RECLAIM, 0);
+  if (!devp->data || !c->slots || !c->batch || !c->io_pool || !c->wq) {
+    printk(KERN_NOTICE "cache allocation failure\n");
+    vmdisk_cache_free(devp);
+    return -ENOMEM;
+  }
+
+  printk(KERN_NOTICE "caching %s, %zu bytes in %u chunks of RAM\n", backing,
+      devp->size, c->nr_slots);
+  return 0;
+}
+
+/* runs the last bios and writes back what they left, no bio comes after */
+static void vmdisk_cache_exit(struct vmdisk_dev *devp) {
+  struct vmdisk_cache *c = &devp->cache;
+
+  if (!c->backing) return;
+  flush_workqueue(c->wq);
+  cancel_delayed_work_sync(&c->wb_work);
+  if (vmdisk_flush(devp))
+    printk(KERN_NOTICE "writes to %s were lost\n", backing);
+  printk(KERN_NOTICE "cache hits %llu misses %llu evictions %llu "
+      "written back %llu\n", c->hits, c->misses, c->evictions,
+      c->written_back);
+  vmdisk_cache_free(devp);
+}
+
 static void setup_device(struct vmdisk_dev *devp) {
   memset(devp, 0, sizeof(struct vmdisk_dev));
 
-  devp->size = NSECTORS * HARDSECT_SIZE;
-  devp->data = vmalloc(devp->size);
-  if (devp->data == NULL) {
-    printk(KERN_NOTICE "vmalloc failure !!!\n");
-    return;
+  if (backing) {
+    if (vmdisk_cache_init(devp)) return;
+  } else {
+    devp->size = nsectors * HARDSECT_SIZE;
+    devp->data = vmalloc(devp->size);
+    if (devp->data == NULL) {
+      printk(KERN_NOTICE "vmalloc failure !!!\n");
+      return;
+    }
   }
 
   spin_lock_init(&devp->lock);
@@ -100,6 +608,8 @@ static void setup_device(struct vmdisk_dev *devp) {
   if (devp->queue == NULL) goto out_vfree;
 
   blk_queue_make_request(devp->queue, vmdisk_make_request);
+  /* so that flushes and FUA writes reach the backing store */
+  if (devp->cache.backing) blk_queue_write_cache(devp->queue, true, true);
 
   blk_queue_logical_block_size(devp->queue, HARDSECT_SIZE);
   devp->queue->queuedata = devp;
@@ -117,12 +627,17 @@ static void setup_device(struct vmdisk_dev *devp) {
   devp->gd->private_data = devp;
   snprintf(devp->gd->disk_name, 32, VMDISK_NAME);
 
-  set_capacity(devp->gd, NSECTORS);
+  set_capacity(devp->gd, devp->size / HARDSECT_SIZE);
   add_disk(devp->gd);
   return;
 
 out_vfree:
-  if (devp->data) vfree(devp->data);
+  if (devp->cache.backing)
+    vmdisk_cache_free(devp);
+  else
+    vfree(devp->data);
+  /* vmdisk_exit frees it too */
+  devp->data = NULL;
 }
 
 static int __init vmdisk_init(void) {
@@ -145,6 +660,9 @@ static void __exit vmdisk_exit(void) {
     del_gendisk(vmdisk_shared_data.gd);
   if (vmdisk_shared_data.queue)
     blk_cleanup_queue(vmdisk_shared_data.queue);
+  vmdisk_cache_exit(&vmdisk_shared_data);
+  /* the benchmark reloads the module with a big disk over and over */
+  vfree(vmdisk_shared_data.data);
 }
 module_exit(vmdisk_exit);
 
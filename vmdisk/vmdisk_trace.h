@@ -0,0 +1,55 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vmdisk
+
+#if !defined(_VMDISK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VMDISK_TRACE_H
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/tracepoint.h>
+
+/* the block layer's own block:* events stop at the make_request boundary */
+
+TRACE_EVENT(vmdisk_bio_submit,
+  TP_PROTO(struct bio *bio),
+  TP_ARGS(bio),
+  TP_STRUCT__entry(
+    __field(sector_t, sector)
+    __field(unsigned int, bytes)
+    __field(unsigned int, opf)
+  ),
+  TP_fast_assign(
+    __entry->sector = bio->bi_iter.bi_sector;
+    __entry->bytes = bio->bi_iter.bi_size;
+    __entry->opf = bio->bi_opf;
+  ),
+  TP_printk("sector=%llu bytes=%u %s opf=%#x",
+      (unsigned long long)__entry->sector, __entry->bytes,
+      op_is_write(__entry->opf) ? "write" : "read", __entry->opf)
+);
+
+TRACE_EVENT(vmdisk_bio_complete,
+  TP_PROTO(struct bio *bio, blk_status_t status),
+  TP_ARGS(bio, status),
+  TP_STRUCT__entry(
+    __field(sector_t, sector)
+    __field(unsigned int, bytes)
+    __field(int, error)
+  ),
+  TP_fast_assign(
+    __entry->sector = bio->bi_iter.bi_sector;
+    __entry->bytes = bio->bi_iter.bi_size;
+    __entry->error = blk_status_to_errno(status);
+  ),
+  TP_printk("sector=%llu bytes=%u error=%d",
+      (unsigned long long)__entry->sector, __entry->bytes, __entry->error)
+);
+
+#endif
+
+/* the module is built out of tree, see CFLAGS_vmdisk.o in the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vmdisk_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,33 @@
+#ifndef VMDISK_TRANSFER_H
+#define VMDISK_TRANSFER_H
+
+/*
+ * The sector copy behind every bio segment, kept free of the block layer so
+ * kunit/vmdisk_test.c can check and time it on its own.
+ */
+
+#include <linux/errno.h>
+#include <linux/overflow.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+#define HARDSECT_SIZE 512
+
+/* copy nsect sectors between data and buffer, -EIO if they run off the end */
+static inline int vmdisk_copy(uint8_t *data, size_t size,
+    unsigned long sector, unsigned long nsect, char *buffer, int write) {
+  unsigned long offset, nbytes, end;
+
+  if (check_mul_overflow(sector, (unsigned long)HARDSECT_SIZE, &offset) ||
+      check_mul_overflow(nsect, (unsigned long)HARDSECT_SIZE, &nbytes) ||
+      check_add_overflow(offset, nbytes, &end) || end > size)
+    return -EIO;
+
+  if (write)
+    memcpy(data + offset, buffer, nbytes);
+  else
+    memcpy(buffer, data + offset, nbytes);
+  return 0;
+}
+
+#endif